@@ -0,0 +1,206 @@
+// Stresses the memory accounting with high-resolution recordings. Every
+// simulated camera holds a decoded frame plus a short history, the way a
+// synced RTSPStream does, and feeds a recorder that writes through the shared
+// disk writer. The memory manager enforces the cap and a per-second
+// breakdown of the accounted memory is printed next to the process RSS, so
+// the FFmpeg estimates can be checked against what the process really uses.
+// Camera buffers are reported to the manager as one subsystem, so only the
+// disk writer backlog can be shrunk here; stream history, decode resolution
+// and pausing need live streams.
+//
+// Usage: memory_bench [streams width height seconds cap_mb]
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RTSPDiskWriter.hpp"
+#include "RTSPMemoryManager.hpp"
+#include "RTSPMetrics.hpp"
+#include "RTSPRecorder.hpp"
+
+namespace {
+
+const int kTargetFps = 20;
+const size_t kHistoryDepth = 4;
+
+// A bar that moves every frame, so the encoders never idle.
+cv::Mat SyntheticFrame(const cv::Size& size, int camera, int index) {
+    cv::Mat frame(size, CV_8UC3,
+                  cv::Scalar((camera * 40) % 256, (index * 3) % 256, 128));
+    cv::rectangle(frame,
+                  cv::Rect((index * 16) % size.width, size.height / 4,
+                           size.width / 8, size.height / 2),
+                  cv::Scalar(255, 255, 255), cv::FILLED);
+    return frame;
+}
+
+size_t ReadResidentMemory() {
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    unsigned long total_pages = 0, resident_pages = 0;
+    if (statm == nullptr) {
+        return 0;
+    }
+    if (std::fscanf(statm, "%lu %lu", &total_pages, &resident_pages) != 2) {
+        resident_pages = 0;
+    }
+    std::fclose(statm);
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+double Value(const nlohmann::json& snapshot, const std::string& block,
+             const std::string& key) {
+    if (!snapshot.contains(block) || !snapshot[block].contains(key)) {
+        return 0.;
+    }
+    return snapshot[block][key].get<double>();
+}
+
+// Records for the given time and keeps the peak of the accounted memory. The
+// recorders are closed on return.
+bool RunStress(int stream_count, const cv::Size& size, int seconds,
+               size_t cap_mb, const std::string& video_path,
+               size_t& peak_total) {
+    RTSPMetrics metrics;
+
+    RTSPDiskWriter disk_writer;
+    disk_writer.SetBackend("threads");
+    disk_writer.SetMaxBacklog(size_t(256) << 20);
+    disk_writer.SetMetrics(&metrics);
+    if (!disk_writer.Initialize()) {
+        return false;
+    }
+
+    std::vector<std::unique_ptr<RTSPRecorder>> recorders;
+    for (int camera = 0; camera < stream_count; ++camera) {
+        auto recorder = std::make_unique<RTSPRecorder>();
+        recorder->SetOutputPath(video_path + "/camera" +
+                                std::to_string(camera));
+        recorder->SetTargetFPS(kTargetFps);
+        recorder->SetFrameSize(size);
+        recorder->SetSegmentDuration(60);
+        recorder->SetContainer("ts");
+        recorder->SetDiskWriter(&disk_writer);
+        if (!recorder->Initialize()) {
+            return false;
+        }
+        recorders.push_back(std::move(recorder));
+    }
+
+    RTSPMemoryManager memory_manager;
+    memory_manager.SetMemoryCap(cap_mb << 20);
+    memory_manager.SetPeriod(250);
+    memory_manager.SetRestoreDelay(2000);
+    memory_manager.SetMetrics(&metrics);
+    for (int camera = 0; camera < stream_count; ++camera) {
+        memory_manager.AddRecorder(recorders[camera].get(),
+                                   "camera" + std::to_string(camera));
+    }
+    memory_manager.SetDiskWriter(&disk_writer);
+    if (!memory_manager.Initialize()) {
+        return false;
+    }
+
+    // Decoded frame and history of every camera, oldest first.
+    std::vector<std::vector<cv::Mat>> histories(stream_count);
+    cv::Mat wall(720, 1280, CV_8UC3);
+    size_t peak_resident = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto next_report = start + std::chrono::seconds(1);
+    std::printf("%4s %8s %8s %8s %8s %8s %8s %8s  %s\n", "s", "total",
+                "capture", "decoder", "encoder", "record", "disk", "rss",
+                "last decision");
+    for (int index = 0;; ++index) {
+        auto frame_start = std::chrono::steady_clock::now();
+        if (frame_start - start >= std::chrono::seconds(seconds)) {
+            break;
+        }
+        size_t capture_bytes = 0, decoder_bytes = 0;
+        for (int camera = 0; camera < stream_count; ++camera) {
+            cv::Mat frame = SyntheticFrame(size, camera, index);
+            histories[camera].push_back(frame);
+            if (histories[camera].size() > kHistoryDepth) {
+                histories[camera].erase(histories[camera].begin());
+            }
+            recorders[camera]->SetFrame(frame);
+            capture_bytes += histories[camera].size() * frame.total() *
+                             frame.elemSize();
+            // The decoder surfaces a live stream would hold.
+            decoder_bytes += RTSPMemoryManager::EstimateDecoderMemory(size);
+        }
+        memory_manager.ReportUsage("capture", capture_bytes);
+        memory_manager.ReportUsage("decoder", decoder_bytes);
+        memory_manager.ReportUsage("compositor",
+                                   wall.total() * wall.elemSize());
+
+        if (frame_start >= next_report) {
+            next_report += std::chrono::seconds(1);
+            nlohmann::json snapshot = metrics.GetSnapshot();
+            nlohmann::json memory =
+                snapshot.contains("memory") ? snapshot["memory"]
+                                            : nlohmann::json::object();
+            size_t resident = ReadResidentMemory();
+            double total_mb = memory.value("total_mb", 0.);
+            peak_total = std::max(peak_total,
+                                  static_cast<size_t>(total_mb * (1 << 20)));
+            peak_resident = std::max(peak_resident, resident);
+            std::printf(
+                "%4d %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f  %s\n",
+                static_cast<int>(std::chrono::duration_cast<
+                                     std::chrono::seconds>(frame_start - start)
+                                     .count()),
+                total_mb, Value(memory, "subsystems", "capture_mb"),
+                Value(memory, "subsystems", "decoder_mb"),
+                Value(memory, "subsystems", "encoder_mb"),
+                Value(memory, "subsystems", "recorders_mb"),
+                Value(memory, "subsystems", "disk_writer_mb"),
+                static_cast<double>(resident) / (1 << 20),
+                memory.value("last_decision", std::string("none")).c_str());
+        }
+        std::this_thread::sleep_until(
+            frame_start + std::chrono::microseconds(1000000 / kTargetFps));
+    }
+
+    std::printf("peak resident:  %zu MB\n", peak_resident >> 20);
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int stream_count = 8;
+    cv::Size size(3840, 2160);
+    int seconds = 20;
+    size_t cap_mb = 4096;
+    if (argc == 6) {
+        stream_count = std::stoi(argv[1]);
+        size = cv::Size(std::stoi(argv[2]), std::stoi(argv[3]));
+        seconds = std::stoi(argv[4]);
+        cap_mb = std::stoul(argv[5]);
+    }
+
+    std::string video_path =
+        (std::filesystem::temp_directory_path() / "memory_bench").string();
+    std::filesystem::remove_all(video_path);
+    size_t peak_total = 0;
+    bool started = RunStress(stream_count, size, seconds, cap_mb, video_path,
+                             peak_total);
+    std::filesystem::remove_all(video_path);
+    if (!started) {
+        std::cerr << "Failed to start the recording pipeline" << std::endl;
+        return 1;
+    }
+
+    std::printf("cap:            %zu MB\n", cap_mb);
+    std::printf("peak accounted: %zu MB\n", peak_total >> 20);
+    return peak_total <= (cap_mb << 20) ? 0 : 2;
+}
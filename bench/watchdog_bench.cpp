@@ -0,0 +1,128 @@
+// Measures the per-frame cost of the stream watchdog check against the cost
+// of decoding the same frames. A synthetic clip is encoded once, decoded with
+// the same grab()/retrieve() calls as RTSPStream, and every decoded frame is
+// inspected as if the watchdog checked each frame. Frames go through a small
+// ring and are inspected a few frames after their decode, so long clips do
+// not hold every frame and inspection does not read cache-hot frames.
+//
+// Usage: watchdog_bench [width height frames]
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "RTSPWatchdog.hpp"
+
+namespace {
+
+const double kBudgetPercent = 1.;
+const size_t kRingSize = 4;
+
+double ElapsedUs(std::chrono::steady_clock::time_point start) {
+    return static_cast<double>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+}
+
+// A moving gradient with sensor-like noise, so the encoder has real work.
+cv::Mat SyntheticFrame(const cv::Size& size, int index) {
+    cv::Mat frame(size, CV_8UC3);
+    for (int y = 0; y < size.height; ++y) {
+        auto* row = frame.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < size.width; ++x) {
+            row[x] = cv::Vec3b(static_cast<uchar>(x + index * 4),
+                               static_cast<uchar>(y + index * 2),
+                               static_cast<uchar>((x + y) / 2));
+        }
+    }
+    cv::Mat noise(size, CV_8UC3);
+    cv::randn(noise, cv::Scalar::all(0), cv::Scalar::all(6));
+    frame += noise;
+    cv::putText(frame, std::to_string(index), cv::Point(40, 80),
+                cv::FONT_HERSHEY_SIMPLEX, 2., cv::Scalar(255, 255, 255), 3);
+    return frame;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    cv::Size size(1920, 1080);
+    int frame_count = 250;
+    if (argc == 4) {
+        size = cv::Size(std::stoi(argv[1]), std::stoi(argv[2]));
+        frame_count = std::stoi(argv[3]);
+    }
+
+    std::string clip_path =
+        (std::filesystem::temp_directory_path() / "watchdog_bench.mp4")
+            .string();
+    cv::VideoWriter writer(clip_path,
+                           cv::VideoWriter::fourcc('a', 'v', 'c', '1'), 25.,
+                           size);
+    if (!writer.isOpened()) {
+        writer.open(clip_path, cv::VideoWriter::fourcc('m', 'p', '4', 'v'),
+                    25., size);
+    }
+    if (!writer.isOpened()) {
+        std::cerr << "Failed to encode the benchmark clip" << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < frame_count; ++i) {
+        writer.write(SyntheticFrame(size, i));
+    }
+    writer.release();
+
+    cv::VideoCapture capture(clip_path, cv::CAP_FFMPEG);
+    if (!capture.isOpened()) {
+        std::cerr << "Failed to decode the benchmark clip" << std::endl;
+        return 1;
+    }
+    std::vector<cv::Mat> ring(kRingSize);
+    size_t decoded = 0, inspected = 0;
+    cv::Mat previous_thumbnail, thumbnail;
+    double decode_us = 0., inspect_us = 0.;
+    auto inspect = [&]() {
+        auto start = std::chrono::steady_clock::now();
+        RTSPWatchdog::Inspect(ring[inspected % kRingSize], previous_thumbnail,
+                              thumbnail);
+        inspect_us += ElapsedUs(start);
+        std::swap(previous_thumbnail, thumbnail);
+        ++inspected;
+    };
+    while (true) {
+        // Frees the slot of the oldest frame for the next decode.
+        if (decoded == inspected + kRingSize) {
+            inspect();
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!capture.grab() || !capture.retrieve(ring[decoded % kRingSize])) {
+            break;
+        }
+        decode_us += ElapsedUs(start);
+        ++decoded;
+    }
+    while (inspected < decoded) {
+        inspect();
+    }
+    std::filesystem::remove(clip_path);
+    if (decoded == 0) {
+        std::cerr << "No frames decoded" << std::endl;
+        return 1;
+    }
+
+    double frames_decoded = static_cast<double>(decoded);
+    double overhead_percent = 100. * inspect_us / decode_us;
+    std::printf("resolution:        %dx%d\n", size.width, size.height);
+    std::printf("frames:            %zu\n", decoded);
+    std::printf("decode per frame:  %.1f us\n", decode_us / frames_decoded);
+    std::printf("inspect per frame: %.1f us\n", inspect_us / frames_decoded);
+    std::printf("overhead:          %.3f %% (budget %.1f %%)\n",
+                overhead_percent, kBudgetPercent);
+    return overhead_percent < kBudgetPercent ? 0 : 2;
+}
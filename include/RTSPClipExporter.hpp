@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "RTSPRecorder.hpp"
+
+class RTSPClipExporterException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Cuts a clip out of the recorded segments of one stream without decoding:
+// the sidecar indexes give the keyframe at or before the start time and the
+// media time of the end, and ffmpeg's concat demuxer remuxes the covered
+// segments with stream copy. The ffmpeg executable must be on PATH; the
+// FFmpeg libraries OpenCV links do not provide it.
+class RTSPClipExporter {
+public:
+    RTSPClipExporter();
+
+    ~RTSPClipExporter();
+
+    void SetRecordingsPath(const std::string&);
+
+    void SetTimeRange(int64_t, int64_t);
+
+    void SetOutputPath(const std::string&);
+
+    bool Export();
+
+    static int64_t ParseTime(const std::string&);
+
+private:
+    struct Segment {
+        int64_t start_ms = 0;
+        std::string path;
+    };
+
+    std::vector<Segment> FindSegments();
+
+    std::vector<RTSPIndexRecord> ReadIndex(const Segment&);
+
+    std::string recordings_path_;
+    std::string output_path_;
+    int64_t from_ms_ = 0;
+    int64_t to_ms_ = 0;
+};
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -29,7 +30,14 @@ public:
     std::vector<std::unordered_map<std::string, std::string>>
     GetStreamCredentials();
 
+    nlohmann::json GetSection(const std::string&);
+
 private:
+    void VerifySyncGroups(const nlohmann::json&);
+
+    void VerifyBlockFields(const std::string&, const nlohmann::json&,
+                           const std::vector<std::string>&);
+
     std::string config_path_;
     nlohmann::json config_data_;
     std::vector<std::unordered_map<std::string, std::string>> streams_;
@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef RTSP_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "RTSPMetrics.hpp"
+
+class RTSPDiskWriterException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Shared asynchronous writer for all recorders. Writes are gathered into
+// large, page-aligned chunks per file and handed to io_uring (when built with
+// liburing) or to a pool of pwrite() threads. The amount of queued data is
+// bounded: once the backlog is full, producers either wait ("block") or the
+// chunk is dropped and leaves a hole in the file ("drop").
+class RTSPDiskWriter {
+public:
+    RTSPDiskWriter();
+
+    ~RTSPDiskWriter();
+
+    void SetBackend(const std::string&);
+
+    void SetThreadCount(int);
+
+    void SetQueueDepth(int);
+
+    void SetChunkSize(size_t);
+
+    size_t GetChunkSize();
+
+    void SetMaxBacklog(size_t);
+
+    size_t GetMaxBacklog();
+
+    void SetOverflowPolicy(const std::string&);
+
+    void SetFlushPolicy(const std::string&);
+
+    void SetFlushInterval(int);
+
+    void SetDirectIO(bool);
+
+    void SetMetrics(RTSPMetrics*);
+
+    bool Initialize();
+
+    int Open(const std::string&);
+
+    bool Write(int, const void*, size_t);
+
+    void Close(int);
+
+    size_t GetMemoryUsage();
+
+    void WriteLoop();
+
+    void RingLoop();
+
+    void FlushLoop();
+
+    RTSPDiskWriter(const RTSPDiskWriter&) = delete;
+    RTSPDiskWriter& operator=(const RTSPDiskWriter&) = delete;
+
+private:
+    struct Chunk;
+
+    struct File {
+        int descriptor = -1;
+        std::string path;
+        // Only touched by the producer of the file.
+        Chunk* current = nullptr;
+        int64_t size = 0;
+        bool direct_io = false;
+        // Guarded by queue_mutex_.
+        int pending_chunks = 0;
+        bool closing = false;
+        bool dirty = false;
+        std::chrono::steady_clock::time_point last_sync;
+    };
+
+    struct Chunk {
+        std::shared_ptr<File> file;
+        uint8_t* data = nullptr;
+        int64_t offset = 0;
+        size_t size = 0;
+        size_t written = 0;
+    };
+
+    Chunk* AcquireChunk(const std::shared_ptr<File>&);
+
+    void ReleaseChunk(Chunk*);
+
+    void Enqueue(Chunk*);
+
+    void CompleteChunk(Chunk*, bool);
+
+    void SyncFiles(bool);
+
+    void PublishMetrics(double);
+
+    void Stop();
+
+    std::atomic<bool> running_{false};
+    std::atomic<bool> writers_stopped_{false};
+    std::vector<std::thread> write_threads_;
+    std::thread flush_thread_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::condition_variable space_cv_;
+    std::condition_variable flush_cv_;
+    std::deque<Chunk*> queue_;
+    std::vector<uint8_t*> free_buffers_;
+    std::unordered_map<int, std::shared_ptr<File>> files_;
+    int next_handle_ = 0;
+    RTSPMetrics* metrics_ = nullptr;
+#ifdef RTSP_HAVE_LIBURING
+    io_uring ring_;
+    bool ring_initialized_ = false;
+#endif
+    std::string backend_ = "io_uring";
+    std::string overflow_policy_ = "block";
+    std::string flush_policy_ = "close";
+    int thread_count_ = 2;
+    int queue_depth_ = 32;
+    int flush_interval_ms_ = 1000;
+    bool direct_io_ = false;
+    size_t chunk_size_ = 1 << 20;
+    size_t max_backlog_ = 256 << 20;
+    size_t backlog_ = 0;
+    size_t inflight_chunks_ = 0;
+    size_t allocated_buffers_ = 0;
+    uint64_t bytes_written_ = 0;
+    uint64_t last_bytes_written_ = 0;
+    uint64_t dropped_bytes_ = 0;
+    uint64_t write_errors_ = 0;
+    uint64_t stall_time_us_ = 0;
+};
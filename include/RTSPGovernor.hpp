@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RTSPMetrics.hpp"
+#include "RTSPStream.hpp"
+#include "RTSPSupervisor.hpp"
+
+class RTSPGovernorException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Keeps the host CPU usage under a configured budget. While the budget is
+// exceeded, the governor degrades one stream per period, starting with the
+// lowest priority one (a higher priority value means a more important
+// camera): reduced frame rate, then sparse frames, then paused. Only the
+// paused mode stops the decoder; the lighter modes save the colour conversion
+// and everything done per published frame downstream. Recorded streams keep
+// decoding every frame, so degrading them only saves display work: they are
+// degraded after all other streams are paused. Streams without an open
+// decoder are skipped. Once the load stays
+// below the budget minus the hysteresis for the restore delay, streams are
+// restored one step at a time in the reverse order. In supervisor mode the
+// streams live in the workers; they are governed through the shared stream
+// stats and the decode mode the supervisor requests from their worker.
+class RTSPGovernor {
+public:
+    RTSPGovernor();
+
+    ~RTSPGovernor();
+
+    void SetCpuBudget(double);
+
+    void SetHysteresis(double);
+
+    void SetPeriod(int);
+
+    void SetRestoreDelay(int);
+
+    void SetMetrics(RTSPMetrics*);
+
+    void AddStream(RTSPStream*, int);
+
+    void AddStream(RTSPSupervisor*, int, const std::string&, int);
+
+    bool Initialize();
+
+    void GovernLoop();
+
+    RTSPGovernor(const RTSPGovernor&) = delete;
+    RTSPGovernor& operator=(const RTSPGovernor&) = delete;
+
+private:
+    struct GovernedStream {
+        RTSPStream* stream = nullptr;
+        RTSPSupervisor* supervisor = nullptr;
+        int stream_index = -1;
+        std::string name;
+        int priority = 0;
+        RTSPDecodeMode decode_mode = RTSPDecodeMode::kFull;
+        RTSPStreamStats last_stats;
+        double decode_us_per_frame = 0.;
+        double decode_fps = 0.;
+        double decode_cpu_percent = 0.;
+    };
+
+    double MeasureCpuUsage();
+
+    RTSPStreamStats GetStats(const GovernedStream&);
+
+    void ApplyDecodeMode(GovernedStream&, RTSPDecodeMode);
+
+    bool IsDecoding(const GovernedStream&);
+
+    bool ShedsDecode(const GovernedStream&);
+
+    void UpdateStreamCosts(double);
+
+    bool DegradeStream();
+
+    bool RestoreStream();
+
+    void PublishMetrics(double);
+
+    std::atomic<bool> running_{false};
+    std::thread govern_thread_;
+    std::mutex streams_mutex_;
+    std::vector<GovernedStream> streams_;
+    RTSPMetrics* metrics_ = nullptr;
+    double cpu_budget_percent_ = 80.;
+    double hysteresis_percent_ = 10.;
+    int period_ms_ = 1000;
+    int restore_delay_ms_ = 5000;
+    uint64_t last_cpu_busy_ = 0;
+    uint64_t last_cpu_total_ = 0;
+    std::chrono::steady_clock::time_point last_update_;
+    std::chrono::steady_clock::time_point below_budget_since_;
+    bool below_budget_ = false;
+    std::string last_decision_ = "none";
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RTSPDiskWriter.hpp"
+#include "RTSPMetrics.hpp"
+#include "RTSPRecorder.hpp"
+#include "RTSPStream.hpp"
+
+class RTSPMemoryManagerException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Accounts for the frame buffers of every stream and subsystem and keeps
+// their total under a global cap. Buffers held inside FFmpeg are not
+// visible, so decoders and encoders are accounted with an estimate from
+// their frame size. While the total is over the cap, one step is shrunk per
+// period, cheapest first: the frame history of the lowest priority stream,
+// then the disk writer backlog, then the decoded resolution of the lowest
+// priority stream that is not recorded. Downscaling happens after the
+// decoder, so it only saves the frames the stream holds; recorded streams are
+// left alone because their recorder scales every frame back up. The decoder
+// surfaces dominate the total of high-resolution streams, so the last resort
+// pauses the lowest priority stream that is not recorded, which closes its
+// decoder. Steps are undone in the reverse order once the total stays below
+// the cap minus the hysteresis for the restore delay, and only when the
+// restored buffers still fit under that line.
+class RTSPMemoryManager {
+public:
+    RTSPMemoryManager();
+
+    ~RTSPMemoryManager();
+
+    void SetMemoryCap(size_t);
+
+    void SetHysteresis(double);
+
+    void SetPeriod(int);
+
+    void SetRestoreDelay(int);
+
+    void SetMetrics(RTSPMetrics*);
+
+    void AddStream(RTSPStream*, int);
+
+    void AddRecorder(RTSPRecorder*, const std::string&);
+
+    void SetDiskWriter(RTSPDiskWriter*);
+
+    void ReportUsage(const std::string&, size_t);
+
+    bool Initialize();
+
+    void ManageLoop();
+
+    static size_t EstimateDecoderMemory(const cv::Size&);
+
+    static size_t EstimateEncoderMemory(const cv::Size&);
+
+    RTSPMemoryManager(const RTSPMemoryManager&) = delete;
+    RTSPMemoryManager& operator=(const RTSPMemoryManager&) = delete;
+
+private:
+    struct ManagedStream {
+        RTSPStream* stream = nullptr;
+        int priority = 0;
+        int original_history_depth = 0;
+        int downscale_level = 0;
+        bool paused = false;
+        size_t frame_bytes = 0;
+        size_t decoder_bytes = 0;
+        size_t recorder_bytes = 0;
+    };
+
+    struct ManagedRecorder {
+        RTSPRecorder* recorder = nullptr;
+        std::string owner;
+    };
+
+    size_t Account();
+
+    bool Shrink();
+
+    bool Restore(size_t, size_t);
+
+    size_t ReadResidentMemory();
+
+    void PublishMetrics(size_t);
+
+    std::atomic<bool> running_{false};
+    std::thread manage_thread_;
+    std::mutex manager_mutex_;
+    std::vector<ManagedStream> streams_;
+    std::vector<ManagedRecorder> recorders_;
+    std::map<std::string, size_t> subsystems_;
+    std::map<std::string, size_t> reported_usage_;
+    RTSPDiskWriter* disk_writer_ = nullptr;
+    RTSPMetrics* metrics_ = nullptr;
+    size_t memory_cap_ = 0;
+    size_t original_backlog_ = 0;
+    double hysteresis_percent_ = 10.;
+    int period_ms_ = 500;
+    int restore_delay_ms_ = 10000;
+    int shrink_steps_ = 0;
+    std::chrono::steady_clock::time_point below_cap_since_;
+    bool below_cap_ = false;
+    std::string last_decision_ = "none";
+};
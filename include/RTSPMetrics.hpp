@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "nlohmann/json.hpp"
+
+class RTSPMetricsException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Thread-safe registry of named values shared by all subsystems. Names are
+// dot-separated paths (e.g. "streams.stream_1.decode_fps") and are expanded
+// into nested JSON objects in the snapshot. When an output path is set, the
+// snapshot is periodically written to that file.
+class RTSPMetrics {
+public:
+    RTSPMetrics();
+
+    ~RTSPMetrics();
+
+    void SetOutputPath(const std::string&);
+
+    void SetReportPeriod(int);
+
+    bool Initialize();
+
+    void SetValue(const std::string&, double);
+
+    void SetLabel(const std::string&, const std::string&);
+
+    void AddToCounter(const std::string&, double);
+
+    void MergeSnapshot(const std::string&, const nlohmann::json&);
+
+    nlohmann::json GetSnapshot();
+
+    void ReportLoop();
+
+    RTSPMetrics(const RTSPMetrics&) = delete;
+    RTSPMetrics& operator=(const RTSPMetrics&) = delete;
+
+private:
+    void WriteSnapshot();
+
+    void MergeValues(const std::string&, const nlohmann::json&);
+
+    std::atomic<bool> running_{false};
+    std::thread report_thread_;
+    std::mutex metrics_mutex_;
+    std::map<std::string, nlohmann::json> values_;
+    std::string output_path_;
+    int report_period_ms_ = 1000;
+};
@@ -1,14 +1,49 @@
 #pragma once
 #include <atomic>
+#include <cstdint>
+#include <fstream>
 #include <mutex>
 #include <opencv2/opencv.hpp>
 #include <stdexcept>
 #include <thread>
 
+#include "RTSPDiskWriter.hpp"
+
 class RTSPRecorderException : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+enum RTSPIndexFlags : uint32_t {
+    // OpenCV's writer does not report which frames it encodes as intra
+    // frames, so keyframes are estimated from its default GOP size.
+    kIndexEstimatedKeyframe = 1,
+    kIndexEvent = 2,
+    kIndexMotion = 4,
+    // Wall recordings only encode canvases that changed, so every encoded
+    // frame gets a record to map wall time to media time.
+    kIndexFrame = 8,
+};
+
+// Fixed-size record of the sidecar index written next to every segment
+// ("<segment>.idx"). Records are appended in recording order, so both time
+// fields are monotonic within a segment.
+struct RTSPIndexRecord {
+    int64_t wall_time_ms;
+    int64_t media_time_ms;
+    uint32_t frame_number;
+    uint32_t flags;
+};
+
+// Records frames into "<output path>/<segment start epoch ms>.<container>"
+// segments and writes a sidecar index of their keyframes, motion and event
+// markers. With a shared RTSPDiskWriter, the encoder writes into a FIFO that
+// is pumped into the writer, which absorbs disk latency up to its backlog.
+// Once the backlog is full, the default "block" overflow policy stalls the
+// pump, then the FIFO and the encoder in the record thread; the "drop" policy
+// keeps recording and leaves holes in the segment instead. Frames are handed
+// over through a double buffer, so neither stalls the caller of SetFrame().
+// In wall mode the recorder takes the compositor's canvas and only encodes
+// it when it was updated since the last encoded frame.
 class RTSPRecorder {
 public:
     RTSPRecorder();
@@ -21,19 +56,64 @@ public:
 
     void SetFrameSize(const cv::Size&);
 
+    void SetSegmentDuration(int);
+
+    void SetContainer(const std::string&);
+
+    void SetMotionThreshold(double);
+
+    void SetDiskWriter(RTSPDiskWriter*);
+
+    void SetWallMode(bool);
+
     bool Initialize();
 
     void SetFrame(const cv::Mat&);
 
+    void MarkEvent();
+
+    cv::Size GetFrameSize();
+
+    size_t GetMemoryUsage();
+
     void RecordLoop();
 
+    void WallRecordLoop();
+
 private:
+    bool OpenSegment();
+
+    void CloseSegment();
+
+    void WriteIndexRecord(uint32_t);
+
+    bool DetectMotion(const cv::Mat&);
+
+    void PumpLoop(std::string, int);
+
     std::atomic<bool> connected_{false};
+    std::atomic<bool> event_pending_{false};
     std::thread capture_thread_;
+    std::thread pump_thread_;
     std::mutex frame_mutex_;
     cv::VideoWriter video_writer_;
+    std::ofstream index_file_;
+    RTSPDiskWriter* disk_writer_ = nullptr;
+    // Back buffer written by SetFrame().
     cv::Mat frame_;
+    // Front buffer owned by the record thread.
+    cv::Mat front_frame_;
+    cv::Mat resized_frame_;
+    cv::Mat motion_reference_;
     std::string output_path_;
+    std::string container_ = "mp4";
     int target_fps_ = 0;
+    int segment_duration_s_ = 300;
+    double motion_threshold_ = 0.;
+    bool wall_mode_ = false;
+    bool frame_pending_ = false;
+    int64_t segment_start_ms_ = 0;
+    int64_t last_motion_ms_ = 0;
+    uint32_t segment_frames_ = 0;
     cv::Size frame_size_ = cv::Size(0, 0);
-};
\ No newline at end of file
+};
@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+
+#include "RTSPStream.hpp"
+
+class RTSPSharedFramesException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Room for the JSON metrics snapshot a worker forwards to the supervisor.
+const size_t kSharedMetricsSize = 64 << 10;
+
+// The metrics sequence is a seqlock like the tile sequence below.
+struct RTSPSharedWorkerHeader {
+    std::atomic<int64_t> heartbeat_ms{0};
+    std::atomic<int32_t> pid{0};
+    std::atomic<uint32_t> ready{0};
+    std::atomic<uint64_t> metrics_sequence{0};
+    std::atomic<uint32_t> metrics_size{0};
+    char metrics[kSharedMetricsSize];
+};
+
+// Every stream slot is written by exactly one worker. The sequence counter is
+// a seqlock: it is odd while the tile is being written. The requested decode
+// mode is written by the supervisor's governor and applied by the worker.
+struct RTSPSharedStreamHeader {
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint32_t> connected{0};
+    std::atomic<uint32_t> decode_mode{0};
+    std::atomic<uint32_t> requested_decode_mode{0};
+    std::atomic<uint32_t> reconnect_requested{0};
+    // Whether the stream has a decoder open and whether it is recorded, so
+    // the governor knows what degrading it sheds.
+    std::atomic<uint32_t> decoding{0};
+    std::atomic<uint32_t> recorded{0};
+    std::atomic<uint64_t> grabbed_frames{0};
+    std::atomic<uint64_t> decoded_frames{0};
+    std::atomic<uint64_t> decode_time_us{0};
+};
+
+// POSIX shared memory segment used by the sharding supervisor and its worker
+// processes: worker heartbeats and metrics followed by one display tile and
+// its stats per stream.
+class RTSPSharedFrames {
+public:
+    RTSPSharedFrames();
+
+    ~RTSPSharedFrames();
+
+    bool Create(const std::string&, int, int, const cv::Size&);
+
+    bool Open(const std::string&);
+
+    void Close();
+
+    int GetWorkerCount();
+
+    int GetStreamCount();
+
+    cv::Size GetTileSize();
+
+    size_t GetSegmentSize();
+
+    RTSPSharedWorkerHeader* GetWorker(int);
+
+    RTSPSharedStreamHeader* GetStream(int);
+
+    void Heartbeat(int);
+
+    int64_t GetHeartbeatAge(int);
+
+    void WriteFrame(int, const cv::Mat&);
+
+    void WriteStats(int, bool, RTSPDecodeMode, const RTSPStreamStats&);
+
+    bool ReadFrame(int, cv::Mat&);
+
+    bool WriteMetrics(int, const std::string&);
+
+    bool ReadMetrics(int, std::string&);
+
+    RTSPSharedFrames(const RTSPSharedFrames&) = delete;
+    RTSPSharedFrames& operator=(const RTSPSharedFrames&) = delete;
+
+private:
+    struct SegmentHeader {
+        uint32_t magic;
+        int32_t worker_count;
+        int32_t stream_count;
+        int32_t tile_width;
+        int32_t tile_height;
+        uint64_t slot_size;
+        uint64_t segment_size;
+    };
+
+    bool Map(size_t);
+
+    uint8_t* GetSlot(int);
+
+    std::string name_;
+    bool owner_ = false;
+    int descriptor_ = -1;
+    uint8_t* segment_ = nullptr;
+    size_t segment_size_ = 0;
+    SegmentHeader* header_ = nullptr;
+};
@@ -1,11 +1,40 @@
 #pragma once
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <deque>
 #include <mutex>
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <thread>
 
+// Decoding modes used to shed load, ordered from the cheapest degradation to
+// the most aggressive one. grab() decodes every packet with OpenCV's FFmpeg
+// backend, so kReducedRate (every reduced_fps_divider-th frame) and kSparse
+// (one frame per sparse_interval) only skip retrieve(), i.e. the colour
+// conversion, the copy and the downstream work per published frame. kPaused
+// closes the capture, which stops the decoder, and reconnects on restore.
+// Recorded streams keep retrieving every frame, so for them every mode only
+// saves the display work. The memory manager pauses streams on its own flag,
+// so the governor can not resume them.
+enum class RTSPDecodeMode { kFull, kReducedRate, kSparse, kPaused };
+
+struct RTSPStreamStats {
+    uint64_t grabbed_frames = 0;
+    uint64_t decoded_frames = 0;
+    // CPU time the capture thread spent in grab() and retrieve(). Helper
+    // threads FFmpeg may start for frame-threaded decoding are not included.
+    uint64_t decode_time_us = 0;
+    // Wall clock ms of the last grabbed packet, 0 before the first one.
+    int64_t last_arrival_ms = 0;
+};
+
+// Decoded frame with its capture time in wall clock ms.
+struct RTSPTimedFrame {
+    int64_t timestamp_ms = 0;
+    cv::Mat frame;
+};
+
 class RTSPStream {
 public:
     RTSPStream();
@@ -22,6 +51,14 @@ public:
 
     void SetSource(const std::string&);
 
+    void SetName(const std::string&);
+
+    void SetBackupUrl(const std::string&);
+
+    void SetTimeouts(int, int);
+
+    std::string GetName();
+
     bool Initialize();
 
     bool Connect(int timeout_ms = 5000);
@@ -30,6 +67,12 @@ public:
 
     void RequestReconnect();
 
+    void RequestFailover();
+
+    bool HasBackup();
+
+    bool IsOnBackup();
+
     void CaptureLoop();
 
     bool IsRunning();
@@ -38,28 +81,98 @@ public:
 
     cv::Mat GetFrame();
 
+    bool PeekFrame(cv::Mat&);
+
+    cv::Size GetFrameSize();
+
+    void SetDecodeMode(RTSPDecodeMode);
+
+    RTSPDecodeMode GetDecodeMode();
+
+    void SetRecorded(bool);
+
+    bool IsRecorded();
+
+    void SetMemoryPaused(bool);
+
+    bool IsMemoryPaused();
+
+    bool IsCaptureReleased();
+
+    void SetReducedFpsDivider(int);
+
+    void SetSparseInterval(int);
+
+    RTSPStreamStats GetStats();
+
+    void SetHistoryDepth(int);
+
+    int GetHistoryDepth();
+
+    void SetDownscale(int);
+
+    int GetDownscale();
+
+    size_t GetMemoryUsage();
+
+    int64_t GetFrameTimestamp();
+
+    bool GetFrameAt(int64_t, RTSPTimedFrame&);
+
     RTSPStream(const RTSPStream&) = delete;
     RTSPStream& operator=(const RTSPStream&) = delete;
 
 private:
+    bool ShouldDecodeFrame(uint64_t);
+
+    int64_t StampFrame(int64_t);
+
+    void Failover();
+
     std::string login_;
     std::string password_;
     std::string ip_address_;
     std::string port_;
     std::string source_;
+    std::string name_;
     int stream_width_ = 0;
     int stream_height_ = 0;
     double stream_fps_ = 0.;
     std::string stream_full_url_;
+    std::string primary_url_;
+    std::string backup_url_;
     cv::VideoCapture stream_;
     cv::Mat current_frame_;
+    int64_t current_timestamp_ms_ = 0;
+    // Recent decoded frames, oldest first, for cross-camera alignment.
+    std::deque<RTSPTimedFrame> history_;
+    std::atomic<int> history_depth_{0};
+    // Decoded frames are shrunk by this factor to save memory.
+    std::atomic<int> downscale_{1};
+    // Offset from the camera media clock to the wall clock, only used by the
+    // capture thread.
+    double clock_offset_ms_ = 0.;
+    bool clock_anchored_ = false;
     std::atomic<bool> running_{false};
     std::atomic<bool> connected_{false};
     std::atomic<bool> reconnect_requested_{false};
+    std::atomic<bool> failover_requested_{false};
+    std::atomic<bool> on_backup_{false};
     std::mutex frame_mutex_;
     std::thread capture_thread_;
     int reconnect_attempts_ = 5;
     std::vector<int> reconnect_times_{1000, 5000, 10000, 20000, 30000};
     int open_timeout_ms_ = 5000;
     int read_timeout_ms_ = 1000;
+    std::atomic<RTSPDecodeMode> decode_mode_{RTSPDecodeMode::kFull};
+    // Recorded streams retrieve every frame in every mode, degrading them
+    // only pauses their display.
+    std::atomic<bool> recorded_{false};
+    std::atomic<bool> memory_paused_{false};
+    std::atomic<int> reduced_fps_divider_{2};
+    std::atomic<int> sparse_interval_{25};
+    std::atomic<uint64_t> grabbed_frames_{0};
+    std::atomic<uint64_t> decoded_frames_{0};
+    std::atomic<uint64_t> decode_time_us_{0};
+    std::atomic<int64_t> last_arrival_ms_{0};
 };
@@ -0,0 +1,120 @@
+#pragma once
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RTSPMetrics.hpp"
+#include "RTSPSharedFrames.hpp"
+#include "RTSPStream.hpp"
+
+class RTSPSupervisorException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Splits the configured streams across worker processes (stream i goes to
+// worker i % workers). Every worker is a re-executed RTSPProcessor pinned to
+// its own CPU set; it publishes display tiles and stream stats through
+// RTSPSharedFrames. Workers that exit or stop sending heartbeats are killed
+// and restarted with the same cameras. The metrics snapshots the workers
+// forward are merged into the supervisor metrics: their stream blocks as they
+// are, everything else below "supervisor.workers.<index>".
+class RTSPSupervisor {
+public:
+    RTSPSupervisor();
+
+    ~RTSPSupervisor();
+
+    void SetConfigPath(const std::string&);
+
+    void SetWorkerCount(int);
+
+    void SetStreamNames(const std::vector<std::string>&);
+
+    void SetTileSize(const cv::Size&);
+
+    void SetCpuSets(const std::vector<std::string>&);
+
+    void SetNumaPinning(bool);
+
+    void SetRestartDelay(int);
+
+    void SetHangTimeout(int);
+
+    void SetStartupTimeout(int);
+
+    void SetMetrics(RTSPMetrics*);
+
+    bool Initialize();
+
+    void SuperviseLoop();
+
+    bool IsConnected(int);
+
+    RTSPDecodeMode GetDecodeMode(int);
+
+    void RequestDecodeMode(int, RTSPDecodeMode);
+
+    RTSPStreamStats GetStreamStats(int);
+
+    bool IsDecoding(int);
+
+    bool IsRecorded(int);
+
+    bool GetFrame(int, cv::Mat&);
+
+    uint64_t GetFrameSequence(int);
+
+    size_t GetSharedMemorySize();
+
+    void RequestReconnect();
+
+    static std::vector<int> ParseCpuList(const std::string&);
+
+    RTSPSupervisor(const RTSPSupervisor&) = delete;
+    RTSPSupervisor& operator=(const RTSPSupervisor&) = delete;
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        std::string cpu_set;
+        int restarts = 0;
+        std::chrono::steady_clock::time_point started_at;
+        std::chrono::steady_clock::time_point restart_at;
+    };
+
+    std::vector<std::string> GetNumaCpuSets();
+
+    bool SpawnWorker(int);
+
+    void StopWorker(int);
+
+    void CheckWorker(int);
+
+    void PublishMetrics();
+
+    void MergeWorkerMetrics(int);
+
+    std::atomic<bool> running_{false};
+    std::thread supervise_thread_;
+    std::mutex workers_mutex_;
+    std::vector<Worker> workers_;
+    RTSPSharedFrames shared_frames_;
+    RTSPMetrics* metrics_ = nullptr;
+    std::string config_path_;
+    std::string shared_frames_name_;
+    std::vector<std::string> stream_names_;
+    std::vector<std::string> cpu_sets_;
+    cv::Size tile_size_ = cv::Size(0, 0);
+    int worker_count_ = 0;
+    bool numa_pinning_ = false;
+    int restart_delay_ms_ = 1000;
+    int hang_timeout_ms_ = 10000;
+    int startup_timeout_ms_ = 120000;
+};
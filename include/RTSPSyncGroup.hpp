@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "RTSPMetrics.hpp"
+#include "RTSPStream.hpp"
+
+class RTSPSyncGroupException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct RTSPSyncStats {
+    uint64_t aligned_sets = 0;
+    uint64_t unaligned_sets = 0;
+    int64_t skew_ms = 0;
+    int64_t max_skew_ms = 0;
+    double mean_skew_ms = 0.;
+    // Skew of the newest frames, i.e. what an unsynchronised wall shows.
+    int64_t unsynced_skew_ms = 0;
+};
+
+// Picks time-aligned frames across streams covering the same scene. Every
+// Synchronize() targets the newest time all connected members have reached
+// and takes the frame closest to it from each member's bounded history. A
+// set whose timestamps spread further than the tolerance is still shown, but
+// is counted as unaligned.
+class RTSPSyncGroup {
+public:
+    RTSPSyncGroup();
+
+    ~RTSPSyncGroup();
+
+    void SetName(const std::string&);
+
+    std::string GetName();
+
+    void SetTolerance(int);
+
+    void SetHistoryDepth(int);
+
+    void SetMetrics(RTSPMetrics*);
+
+    void AddStream(RTSPStream*);
+
+    bool Initialize();
+
+    bool Synchronize();
+
+    bool GetFrame(int, cv::Mat&);
+
+    int64_t GetFrameTimestamp(int);
+
+    RTSPSyncStats GetStats();
+
+    RTSPSyncGroup(const RTSPSyncGroup&) = delete;
+    RTSPSyncGroup& operator=(const RTSPSyncGroup&) = delete;
+
+private:
+    void PublishMetrics(int64_t);
+
+    std::mutex sync_mutex_;
+    std::vector<RTSPStream*> streams_;
+    std::vector<RTSPTimedFrame> frames_;
+    RTSPSyncStats stats_;
+    RTSPMetrics* metrics_ = nullptr;
+    std::string name_;
+    int tolerance_ms_ = 40;
+    int history_depth_ = 8;
+    double total_skew_ms_ = 0.;
+};
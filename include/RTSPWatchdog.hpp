@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RTSPMetrics.hpp"
+#include "RTSPStream.hpp"
+
+class RTSPWatchdogException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+enum class RTSPFeedState { kOk, kFrozen, kBlack, kFlat, kStalled };
+
+// Cheap signature of a decoded frame: the mean absolute difference to the
+// previous thumbnail (-1 without one) and the brightness statistics.
+struct RTSPFrameCheck {
+    double difference = -1.;
+    double mean = 0.;
+    double stddev = 0.;
+};
+
+// Detects feeds that are connected but useless: frozen (bit-identical
+// frames), black or flat (a uniform grey or green frame left by decoder error
+// concealment) for the whole window, or stalled (no packets for the stall
+// timeout). A faulty stream fails over to its backup source when it has one
+// and is reconnected otherwise. Frames are checked on low-resolution
+// thumbnails sampled from the decoded frame, off the capture threads.
+class RTSPWatchdog {
+public:
+    RTSPWatchdog();
+
+    ~RTSPWatchdog();
+
+    void SetCheckPeriod(int);
+
+    void SetWindow(int);
+
+    void SetStallTimeout(int);
+
+    void SetFreezeThreshold(double);
+
+    void SetFlatThreshold(double);
+
+    void SetBlackThreshold(double);
+
+    void SetMetrics(RTSPMetrics*);
+
+    void AddStream(RTSPStream*);
+
+    bool Initialize();
+
+    void WatchLoop();
+
+    static RTSPFrameCheck Inspect(const cv::Mat&, const cv::Mat&, cv::Mat&);
+
+    RTSPWatchdog(const RTSPWatchdog&) = delete;
+    RTSPWatchdog& operator=(const RTSPWatchdog&) = delete;
+
+private:
+    struct WatchedStream {
+        RTSPStream* stream = nullptr;
+        cv::Mat thumbnail;
+        RTSPFrameCheck last_check;
+        uint64_t last_decoded_frames = 0;
+        uint64_t last_decode_time_us = 0;
+        RTSPFeedState state = RTSPFeedState::kOk;
+        RTSPFeedState suspected = RTSPFeedState::kOk;
+        std::chrono::steady_clock::time_point suspected_since;
+        std::chrono::steady_clock::time_point disconnected_since;
+        std::chrono::steady_clock::time_point grace_until;
+        bool connected = true;
+        int64_t arrival_gap_ms = 0;
+        int64_t max_arrival_gap_ms = 0;
+        uint64_t faults = 0;
+    };
+
+    RTSPFeedState Classify(const RTSPFrameCheck&);
+
+    void CheckStream(WatchedStream&, std::chrono::steady_clock::time_point);
+
+    void HandleFault(WatchedStream&, RTSPFeedState,
+                     std::chrono::steady_clock::time_point);
+
+    void PublishMetrics();
+
+    std::atomic<bool> running_{false};
+    std::thread watch_thread_;
+    std::mutex streams_mutex_;
+    std::vector<WatchedStream> streams_;
+    cv::Mat scratch_thumbnail_;
+    RTSPMetrics* metrics_ = nullptr;
+    int check_period_ms_ = 200;
+    int window_ms_ = 5000;
+    int stall_timeout_ms_ = 3000;
+    double freeze_threshold_ = 0.;
+    double flat_threshold_ = 3.;
+    double black_threshold_ = 16.;
+    uint64_t checks_ = 0;
+    uint64_t check_time_us_ = 0;
+    uint64_t decode_time_us_ = 0;
+};
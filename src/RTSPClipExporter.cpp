@@ -0,0 +1,264 @@
+#include "RTSPClipExporter.hpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+// Media time of a wall clock time inside a segment, interpolated from the
+// closest index record at or before it.
+int64_t MediaTimeAt(const std::vector<RTSPIndexRecord>& index,
+                    int64_t wall_time_ms) {
+    auto record = std::upper_bound(
+        index.begin(), index.end(), wall_time_ms,
+        [](int64_t time, const RTSPIndexRecord& index_record) {
+            return time < index_record.wall_time_ms;
+        });
+    if (record == index.begin()) {
+        return 0;
+    }
+    int64_t next_media_time_ms =
+        record != index.end() ? record->media_time_ms : INT64_MAX;
+    --record;
+    // Media time stands still while a wall recording skips frames.
+    return std::min(
+        record->media_time_ms + (wall_time_ms - record->wall_time_ms),
+        next_media_time_ms);
+}
+
+// Media time of the last estimated keyframe at or before a wall clock time.
+// Should the estimate be off, the concat demuxer still starts the stream copy
+// on the preceding real keyframe.
+int64_t KeyframeBefore(const std::vector<RTSPIndexRecord>& index,
+                       int64_t wall_time_ms) {
+    int64_t media_time_ms = 0;
+    for (const auto& record : index) {
+        if (record.wall_time_ms > wall_time_ms) {
+            break;
+        }
+        if (record.flags & kIndexEstimatedKeyframe) {
+            media_time_ms = record.media_time_ms;
+        }
+    }
+    return media_time_ms;
+}
+
+std::string Seconds(int64_t time_ms) {
+    std::ostringstream seconds;
+    seconds << std::fixed << std::setprecision(3) << time_ms / 1000.;
+    return seconds.str();
+}
+
+}  // namespace
+
+RTSPClipExporter::RTSPClipExporter() {}
+
+RTSPClipExporter::~RTSPClipExporter() {}
+
+void RTSPClipExporter::SetRecordingsPath(const std::string& recordings_path) {
+    recordings_path_ = recordings_path;
+}
+
+void RTSPClipExporter::SetTimeRange(int64_t from_ms, int64_t to_ms) {
+    from_ms_ = from_ms;
+    to_ms_ = to_ms;
+}
+
+void RTSPClipExporter::SetOutputPath(const std::string& output_path) {
+    output_path_ = output_path;
+}
+
+int64_t RTSPClipExporter::ParseTime(const std::string& time) {
+    // Either seconds since the epoch or a local "YYYY-MM-DDTHH:MM:SS" time.
+    if (!time.empty() &&
+        time.find_first_not_of("0123456789.") == std::string::npos) {
+        try {
+            return static_cast<int64_t>(std::stod(time) * 1000.);
+        } catch (const std::exception&) {
+            return -1;
+        }
+    }
+    std::tm local_time = {};
+    std::istringstream input(time);
+    input >> std::get_time(&local_time, time.find('T') != std::string::npos
+                                            ? "%Y-%m-%dT%H:%M:%S"
+                                            : "%Y-%m-%d %H:%M:%S");
+    if (input.fail()) {
+        return -1;
+    }
+    local_time.tm_isdst = -1;
+    return static_cast<int64_t>(std::mktime(&local_time)) * 1000;
+}
+
+std::vector<RTSPClipExporter::Segment> RTSPClipExporter::FindSegments() {
+    std::vector<Segment> segments;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(recordings_path_)) {
+        std::string extension = entry.path().extension().string();
+        std::string stem = entry.path().stem().string();
+        if (!entry.is_regular_file() || extension == ".idx" ||
+            extension == ".ffconcat" || stem.empty() ||
+            stem.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        Segment segment;
+        segment.start_ms = std::stoll(stem);
+        segment.path = std::filesystem::absolute(entry.path()).string();
+        segments.push_back(segment);
+    }
+    std::sort(segments.begin(), segments.end(),
+              [](const Segment& first, const Segment& second) {
+                  return first.start_ms < second.start_ms;
+              });
+    return segments;
+}
+
+std::vector<RTSPIndexRecord> RTSPClipExporter::ReadIndex(
+    const Segment& segment) {
+    std::ifstream index_file(segment.path + ".idx",
+                             std::ios::binary | std::ios::ate);
+    if (!index_file.is_open()) {
+        throw RTSPClipExporterException("Index of segment " + segment.path +
+                                        " is missing!");
+    }
+    std::vector<RTSPIndexRecord> index(
+        static_cast<size_t>(index_file.tellg()) / sizeof(RTSPIndexRecord));
+    index_file.seekg(0);
+    index_file.read(reinterpret_cast<char*>(index.data()),
+                    index.size() * sizeof(RTSPIndexRecord));
+    return index;
+}
+
+bool RTSPClipExporter::Export() {
+    try {
+        if (recordings_path_.empty() ||
+            !std::filesystem::is_directory(recordings_path_)) {
+            throw RTSPClipExporterException("Recordings of the stream are "
+                                            "not found in " +
+                                            recordings_path_);
+        }
+        if (from_ms_ < 0 || to_ms_ <= from_ms_) {
+            throw RTSPClipExporterException("Invalid export time range!");
+        }
+        if (output_path_.empty()) {
+            throw RTSPClipExporterException("Output path is empty!");
+        }
+
+        auto lookup_start = std::chrono::steady_clock::now();
+        std::vector<Segment> segments = FindSegments();
+        // The last segment started at or before the clip start holds its
+        // first frame, unless the recording stopped before the clip start;
+        // the following ones are included up to the clip end.
+        auto first = std::upper_bound(
+            segments.begin(), segments.end(), from_ms_,
+            [](int64_t time, const Segment& segment) {
+                return time < segment.start_ms;
+            });
+        if (first != segments.begin()) {
+            --first;
+            std::vector<RTSPIndexRecord> index = ReadIndex(*first);
+            if (first->start_ms < from_ms_ &&
+                (index.empty() || index.back().wall_time_ms < from_ms_)) {
+                ++first;
+            }
+        }
+        auto last = std::lower_bound(
+            first, segments.end(), to_ms_,
+            [](const Segment& segment, int64_t time) {
+                return segment.start_ms < time;
+            });
+        if (first == last) {
+            throw RTSPClipExporterException(
+                "No recordings cover the requested time range!");
+        }
+
+        std::string concat_path = output_path_ + ".ffconcat";
+        {
+            std::ofstream concat_list(concat_path, std::ios::trunc);
+            concat_list << "ffconcat version 1.0" << std::endl;
+            for (auto segment = first; segment != last; ++segment) {
+                std::vector<RTSPIndexRecord> index = ReadIndex(*segment);
+                concat_list << "file '" << segment->path << "'" << std::endl;
+                if (segment == first && from_ms_ > segment->start_ms) {
+                    concat_list << "inpoint "
+                                << Seconds(KeyframeBefore(index, from_ms_))
+                                << std::endl;
+                }
+                if (segment + 1 == last && !index.empty() &&
+                    to_ms_ < index.back().wall_time_ms) {
+                    concat_list << "outpoint "
+                                << Seconds(MediaTimeAt(index, to_ms_))
+                                << std::endl;
+                }
+            }
+        }
+        std::cout << "Located " << last - first << " segments in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - lookup_start)
+                             .count() /
+                         1000.
+                  << " ms" << std::endl;
+
+        // Stream copy only: the clip starts on a keyframe and is never
+        // decoded.
+        std::vector<std::string> arguments = {"ffmpeg",
+                                              "-hide_banner",
+                                              "-loglevel",
+                                              "error",
+                                              "-y",
+                                              "-f",
+                                              "concat",
+                                              "-safe",
+                                              "0",
+                                              "-i",
+                                              concat_path,
+                                              "-c",
+                                              "copy",
+                                              "-avoid_negative_ts",
+                                              "make_zero",
+                                              output_path_};
+        std::vector<char*> argv;
+        for (auto& argument : arguments) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw RTSPClipExporterException("Failed to start ffmpeg!");
+        }
+        if (pid == 0) {
+            execvp("ffmpeg", argv.data());
+            _exit(127);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        std::filesystem::remove(concat_path);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            throw RTSPClipExporterException(
+                "ffmpeg is not found, install it or add it to PATH to "
+                "export clips!");
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            throw RTSPClipExporterException("ffmpeg failed to export the "
+                                            "clip!");
+        }
+        std::cout << "Clip exported to " << output_path_ << std::endl;
+        return true;
+    } catch (const RTSPClipExporterException& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
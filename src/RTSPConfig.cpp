@@ -1,7 +1,19 @@
 #include "RTSPConfig.hpp"
 
+#include <algorithm>
 #include <stdexcept>
 
+namespace {
+
+std::string ValueToString(const nlohmann::json& value) {
+    if (value.is_string()) {
+        return value.get<std::string>();
+    }
+    return value.dump();
+}
+
+}  // namespace
+
 RTSPConfig::RTSPConfig() {}
 
 RTSPConfig::RTSPConfig(const std::string& config_path) {
@@ -41,20 +53,29 @@ bool RTSPConfig::Initialize() {
                       << std::endl;
             for (auto data : config_data_.items()) {
                 if (data.key() == "rtsp_streams") {
-                    for (auto streams : data.value().items()) {
-                        for (auto stream : streams.value().items()) {
-                            std::unordered_map<std::string, std::string>
-                                stream_map;
+                    for (auto stream : data.value().items()) {
+                        std::unordered_map<std::string, std::string>
+                            stream_map;
+                        stream_map.insert(std::pair<std::string, std::string>(
+                            "name", stream.key()));
+                        for (auto stream_prop : stream.value().items()) {
+                            if (!stream_prop.value().is_object()) {
+                                stream_map.insert(
+                                    std::pair<std::string, std::string>(
+                                        stream_prop.key(),
+                                        ValueToString(stream_prop.value())));
+                                continue;
+                            }
                             for (auto stream_credentials :
-                                 stream.value().items()) {
-                                stream_credentials.value();
+                                 stream_prop.value().items()) {
                                 stream_map.insert(
                                     std::pair<std::string, std::string>(
                                         stream_credentials.key(),
-                                        stream_credentials.value()));
+                                        ValueToString(
+                                            stream_credentials.value())));
                             }
-                            streams_.push_back(stream_map);
                         }
+                        streams_.push_back(stream_map);
                     }
                 }
             }
@@ -118,6 +139,20 @@ void RTSPConfig::VerifyConfigStructure(const nlohmann::json& config_file) {
                                 "incorrect:\nCheck stream " + stream.key() +
                                 " network block!");
                         }
+                    } else if (stream_prop.key() == "backup_url") {
+                        if (!stream_prop.value().is_string()) {
+                            throw RTSPConfigStructureException(
+                                std::string("ERROR: ") +
+                                "The backup url of the stream " +
+                                stream.key() + " must be a string!");
+                        }
+                    } else if (stream_prop.key() == "priority") {
+                        if (!stream_prop.value().is_number_integer()) {
+                            throw RTSPConfigStructureException(
+                                std::string("ERROR: ") +
+                                "The priority of the stream " + stream.key() +
+                                " must be an integer!");
+                        }
                     } else {
                         throw RTSPConfigStructureException(
                             std::string("ERROR: ") +
@@ -136,6 +171,14 @@ void RTSPConfig::VerifyConfigStructure(const nlohmann::json& config_file) {
                     record_video_flag = true;
                 } else if (video_recorder_prop.key() == "video_path") {
                     record_path_flag = true;
+                } else if (video_recorder_prop.key() == "target_fps" ||
+                           video_recorder_prop.key() ==
+                               "segment_duration_s" ||
+                           video_recorder_prop.key() == "container" ||
+                           video_recorder_prop.key() == "motion_threshold" ||
+                           video_recorder_prop.key() == "record_wall" ||
+                           video_recorder_prop.key() == "wall_fps") {
+                    continue;
                 } else {
                     throw RTSPConfigStructureException(
                         std::string("ERROR: ") +
@@ -231,6 +274,41 @@ void RTSPConfig::VerifyConfigStructure(const nlohmann::json& config_file) {
                     "The structure of the configuration file is " +
                     "incorrect:\n" + "Check display block");
             }
+        } else if (d.key() == "governor") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"enabled", "cpu_budget_percent",
+                               "hysteresis_percent", "period_ms",
+                               "restore_delay_ms", "reduced_fps_divider",
+                               "sparse_interval"});
+        } else if (d.key() == "supervisor") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"workers", "numa", "cpu_sets",
+                               "restart_delay_ms", "hang_timeout_ms",
+                               "startup_timeout_ms"});
+        } else if (d.key() == "disk_writer") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"enabled", "backend", "threads", "queue_depth",
+                               "chunk_size_kb", "max_backlog_mb", "overflow",
+                               "flush_policy", "flush_interval_ms",
+                               "direct_io"});
+        } else if (d.key() == "sync") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"enabled", "tolerance_ms", "history_depth",
+                               "groups"});
+            VerifySyncGroups(d.value().value("groups",
+                                             nlohmann::json::object()));
+        } else if (d.key() == "watchdog") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"enabled", "check_period_ms", "window_ms",
+                               "stall_timeout_ms", "open_timeout_ms",
+                               "freeze_threshold", "flat_threshold",
+                               "black_threshold"});
+        } else if (d.key() == "memory") {
+            VerifyBlockFields(d.key(), d.value(),
+                              {"enabled", "cap_mb", "hysteresis_percent",
+                               "period_ms", "restore_delay_ms"});
+        } else if (d.key() == "metrics") {
+            VerifyBlockFields(d.key(), d.value(), {"output_path", "period_ms"});
         } else {
             std::cout << "WARNING: An unknown option " << d.key() << " has "
                       << "been detected in the configuration file and will be "
@@ -256,7 +334,56 @@ void RTSPConfig::VerifyConfigStructure(const nlohmann::json& config_file) {
     }
 }
 
+void RTSPConfig::VerifyBlockFields(const std::string& block_name,
+                                   const nlohmann::json& block,
+                                   const std::vector<std::string>& fields) {
+    if (!block.is_object()) {
+        throw RTSPConfigStructureException(
+            std::string("ERROR: ") +
+            "The structure of the configuration file is incorrect:\n" +
+            "Check " + block_name + " block!");
+    }
+    for (auto block_prop : block.items()) {
+        if (std::find(fields.begin(), fields.end(), block_prop.key()) ==
+            fields.end()) {
+            throw RTSPConfigStructureException(
+                std::string("ERROR: ") +
+                "The structure of the configuration file is incorrect:\n" +
+                "Extra fields in properties of the " + block_name +
+                " block: " + block_prop.key());
+        }
+    }
+}
+
+void RTSPConfig::VerifySyncGroups(const nlohmann::json& groups) {
+    bool valid = groups.is_object();
+    if (valid) {
+        for (const auto& group : groups.items()) {
+            if (!group.value().is_array()) {
+                valid = false;
+                break;
+            }
+            for (const auto& stream_name : group.value()) {
+                valid = valid && stream_name.is_string();
+            }
+        }
+    }
+    if (!valid) {
+        throw RTSPConfigStructureException(
+            std::string("ERROR: ") +
+            "The structure of the configuration file is incorrect:\n" +
+            "Sync groups must map group names to lists of stream names!");
+    }
+}
+
 std::vector<std::unordered_map<std::string, std::string>>
 RTSPConfig::GetStreamCredentials() {
     return streams_;
+}
+
+nlohmann::json RTSPConfig::GetSection(const std::string& section_name) {
+    if (config_data_.is_object() && config_data_.contains(section_name)) {
+        return config_data_[section_name];
+    }
+    return nlohmann::json::object();
 }
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "RTSPDiskWriter.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// Page alignment keeps the chunks usable with O_DIRECT.
+const size_t kAlignment = 4096;
+
+size_t Align(size_t size) {
+    return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+}  // namespace
+
+RTSPDiskWriter::RTSPDiskWriter() {}
+
+RTSPDiskWriter::~RTSPDiskWriter() {
+    Stop();
+    for (auto& write_thread : write_threads_) {
+        if (write_thread.joinable()) {
+            write_thread.join();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        writers_stopped_ = true;
+    }
+    flush_cv_.notify_all();
+    if (flush_thread_.joinable()) {
+        flush_thread_.join();
+    }
+#ifdef RTSP_HAVE_LIBURING
+    if (ring_initialized_) {
+        io_uring_queue_exit(&ring_);
+    }
+#endif
+    for (uint8_t* buffer : free_buffers_) {
+        std::free(buffer);
+    }
+}
+
+void RTSPDiskWriter::SetBackend(const std::string& backend) {
+    backend_ = backend;
+}
+
+void RTSPDiskWriter::SetThreadCount(int thread_count) {
+    thread_count_ = thread_count;
+}
+
+void RTSPDiskWriter::SetQueueDepth(int queue_depth) {
+    queue_depth_ = queue_depth;
+}
+
+void RTSPDiskWriter::SetChunkSize(size_t chunk_size) {
+    chunk_size_ = chunk_size;
+}
+
+size_t RTSPDiskWriter::GetChunkSize() { return chunk_size_; }
+
+void RTSPDiskWriter::SetMaxBacklog(size_t max_backlog) {
+    // Can be lowered while running, e.g. by the memory manager. A backlog
+    // below one chunk would never admit a chunk, so it is clamped like
+    // Initialize requires.
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    max_backlog_ = running_ ? std::max(max_backlog, chunk_size_) : max_backlog;
+    while (!free_buffers_.empty() &&
+           allocated_buffers_ * chunk_size_ >
+               max_backlog_ + files_.size() * chunk_size_) {
+        std::free(free_buffers_.back());
+        free_buffers_.pop_back();
+        --allocated_buffers_;
+    }
+    space_cv_.notify_all();
+}
+
+size_t RTSPDiskWriter::GetMaxBacklog() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return max_backlog_;
+}
+
+size_t RTSPDiskWriter::GetMemoryUsage() {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return allocated_buffers_ * chunk_size_;
+}
+
+void RTSPDiskWriter::SetOverflowPolicy(const std::string& overflow_policy) {
+    overflow_policy_ = overflow_policy;
+}
+
+void RTSPDiskWriter::SetFlushPolicy(const std::string& flush_policy) {
+    flush_policy_ = flush_policy;
+}
+
+void RTSPDiskWriter::SetFlushInterval(int flush_interval_ms) {
+    flush_interval_ms_ = flush_interval_ms;
+}
+
+void RTSPDiskWriter::SetDirectIO(bool direct_io) { direct_io_ = direct_io; }
+
+void RTSPDiskWriter::SetMetrics(RTSPMetrics* metrics) { metrics_ = metrics; }
+
+bool RTSPDiskWriter::Initialize() {
+    try {
+        if (chunk_size_ == 0 || chunk_size_ % kAlignment != 0) {
+            throw RTSPDiskWriterException(
+                "Disk writer chunk size must be a multiple of 4 KiB!");
+        }
+        if (max_backlog_ < chunk_size_) {
+            throw RTSPDiskWriterException(
+                "Disk writer backlog must hold at least one chunk!");
+        }
+        if (overflow_policy_ != "block" && overflow_policy_ != "drop") {
+            throw RTSPDiskWriterException("Unknown overflow policy: " +
+                                          overflow_policy_);
+        }
+        if (flush_policy_ != "none" && flush_policy_ != "interval" &&
+            flush_policy_ != "close") {
+            throw RTSPDiskWriterException("Unknown flush policy: " +
+                                          flush_policy_);
+        }
+        if (backend_ != "io_uring" && backend_ != "threads") {
+            throw RTSPDiskWriterException("Unknown disk writer backend: " +
+                                          backend_);
+        }
+        if (thread_count_ <= 0 || queue_depth_ <= 0) {
+            throw RTSPDiskWriterException(
+                "Disk writer threads and queue depth must be positive!");
+        }
+
+        running_ = true;
+        if (backend_ == "io_uring") {
+#ifdef RTSP_HAVE_LIBURING
+            int result = io_uring_queue_init(queue_depth_, &ring_, 0);
+            if (result == 0) {
+                ring_initialized_ = true;
+                write_threads_.emplace_back(&RTSPDiskWriter::RingLoop, this);
+            } else {
+                std::cout << "WARNING: io_uring is not available ("
+                          << std::strerror(-result)
+                          << "), using the thread pool disk writer."
+                          << std::endl;
+                backend_ = "threads";
+            }
+#else
+            std::cout << "WARNING: Built without liburing, using the thread "
+                      << "pool disk writer." << std::endl;
+            backend_ = "threads";
+#endif
+        }
+        if (backend_ == "threads") {
+            for (int thread = 0; thread < thread_count_; ++thread) {
+                write_threads_.emplace_back(&RTSPDiskWriter::WriteLoop, this);
+            }
+        }
+        flush_thread_ = std::thread(&RTSPDiskWriter::FlushLoop, this);
+        return true;
+    } catch (const RTSPDiskWriterException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    Stop();
+    return false;
+}
+
+void RTSPDiskWriter::Stop() {
+    // Set under the lock, so a waiter can not check the flag and block
+    // after the wakeup was sent.
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        running_ = false;
+    }
+    queue_cv_.notify_all();
+    space_cv_.notify_all();
+    flush_cv_.notify_all();
+}
+
+int RTSPDiskWriter::Open(const std::string& path) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool direct_io = direct_io_;
+    int descriptor = open(path.c_str(), flags | (direct_io ? O_DIRECT : 0),
+                          0644);
+    if (descriptor < 0 && direct_io && errno == EINVAL) {
+        std::cout << "WARNING: O_DIRECT is not supported for " << path
+                  << ", using buffered writes." << std::endl;
+        direct_io = false;
+        descriptor = open(path.c_str(), flags, 0644);
+    }
+    if (descriptor < 0) {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno)
+                  << std::endl;
+        return -1;
+    }
+
+    auto file = std::make_shared<File>();
+    file->descriptor = descriptor;
+    file->path = path;
+    file->direct_io = direct_io;
+    file->last_sync = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    int handle = next_handle_++;
+    files_[handle] = file;
+    return handle;
+}
+
+RTSPDiskWriter::Chunk* RTSPDiskWriter::AcquireChunk(
+    const std::shared_ptr<File>& file) {
+    Chunk* chunk = new Chunk();
+    chunk->file = file;
+    chunk->offset = file->size;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (!free_buffers_.empty()) {
+            chunk->data = free_buffers_.back();
+            free_buffers_.pop_back();
+        }
+    }
+    if (chunk->data == nullptr) {
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, kAlignment, chunk_size_) != 0) {
+            delete chunk;
+            return nullptr;
+        }
+        chunk->data = static_cast<uint8_t*>(buffer);
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        ++allocated_buffers_;
+    }
+    return chunk;
+}
+
+void RTSPDiskWriter::ReleaseChunk(Chunk* chunk) {
+    // queue_mutex_ must be held by the caller. The pool keeps no more buffers
+    // than the backlog and the chunks being filled can use.
+    if (allocated_buffers_ * chunk_size_ >
+        max_backlog_ + files_.size() * chunk_size_) {
+        std::free(chunk->data);
+        --allocated_buffers_;
+    } else {
+        free_buffers_.push_back(chunk->data);
+    }
+    delete chunk;
+}
+
+bool RTSPDiskWriter::Write(int handle, const void* data, size_t size) {
+    std::shared_ptr<File> file;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        auto file_entry = files_.find(handle);
+        if (file_entry == files_.end() || file_entry->second->closing) {
+            return false;
+        }
+        file = file_entry->second;
+    }
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        if (file->current == nullptr) {
+            file->current = AcquireChunk(file);
+            if (file->current == nullptr) {
+                return false;
+            }
+        }
+        Chunk* chunk = file->current;
+        size_t copied = std::min(size, chunk_size_ - chunk->size);
+        std::memcpy(chunk->data + chunk->size, bytes, copied);
+        chunk->size += copied;
+        file->size += static_cast<int64_t>(copied);
+        bytes += copied;
+        size -= copied;
+        if (chunk->size == chunk_size_) {
+            file->current = nullptr;
+            Enqueue(chunk);
+        }
+    }
+    return true;
+}
+
+void RTSPDiskWriter::Close(int handle) {
+    std::shared_ptr<File> file;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        auto file_entry = files_.find(handle);
+        if (file_entry == files_.end()) {
+            return;
+        }
+        file = file_entry->second;
+    }
+
+    Chunk* chunk = file->current;
+    file->current = nullptr;
+    if (chunk != nullptr && chunk->size > 0) {
+        if (file->direct_io) {
+            // O_DIRECT needs aligned sizes: the padding is cut off by
+            // ftruncate() when the file is closed.
+            size_t aligned_size = Align(chunk->size);
+            std::memset(chunk->data + chunk->size, 0,
+                        aligned_size - chunk->size);
+            chunk->size = aligned_size;
+        }
+        Enqueue(chunk);
+    } else if (chunk != nullptr) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        ReleaseChunk(chunk);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        file->closing = true;
+    }
+    flush_cv_.notify_one();
+}
+
+void RTSPDiskWriter::Enqueue(Chunk* chunk) {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    if (backlog_ + chunk_size_ > max_backlog_) {
+        if (overflow_policy_ == "drop") {
+            // The file offset still advances, so the dropped data becomes a
+            // hole instead of shifting the rest of the file.
+            dropped_bytes_ += chunk->size;
+            ReleaseChunk(chunk);
+            return;
+        }
+        auto stall_start = std::chrono::steady_clock::now();
+        space_cv_.wait(lock, [this] {
+            return backlog_ + chunk_size_ <= max_backlog_ || !running_;
+        });
+        stall_time_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - stall_start)
+                              .count();
+    }
+    backlog_ += chunk_size_;
+    ++chunk->file->pending_chunks;
+    queue_.push_back(chunk);
+    queue_cv_.notify_one();
+}
+
+void RTSPDiskWriter::CompleteChunk(Chunk* chunk, bool success) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (success) {
+        bytes_written_ += chunk->written;
+        chunk->file->dirty = true;
+    } else {
+        ++write_errors_;
+        std::cerr << "Failed to write to " << chunk->file->path << std::endl;
+    }
+    backlog_ -= chunk_size_;
+    --inflight_chunks_;
+    if (--chunk->file->pending_chunks == 0 && chunk->file->closing) {
+        flush_cv_.notify_one();
+    }
+    ReleaseChunk(chunk);
+    space_cv_.notify_all();
+}
+
+void RTSPDiskWriter::WriteLoop() {
+    while (true) {
+        Chunk* chunk = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_cv_.wait(lock,
+                           [this] { return !queue_.empty() || !running_; });
+            if (queue_.empty()) {
+                break;
+            }
+            chunk = queue_.front();
+            queue_.pop_front();
+            ++inflight_chunks_;
+        }
+
+        bool success = true;
+        while (chunk->written < chunk->size) {
+            ssize_t result =
+                pwrite(chunk->file->descriptor, chunk->data + chunk->written,
+                       chunk->size - chunk->written,
+                       chunk->offset + static_cast<int64_t>(chunk->written));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                success = false;
+                break;
+            }
+            chunk->written += static_cast<size_t>(result);
+        }
+        CompleteChunk(chunk, success);
+    }
+}
+
+void RTSPDiskWriter::RingLoop() {
+#ifdef RTSP_HAVE_LIBURING
+    int inflight = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            if (inflight == 0) {
+                queue_cv_.wait(lock,
+                               [this] { return !queue_.empty() || !running_; });
+                if (queue_.empty()) {
+                    break;
+                }
+            }
+            // Batch as many chunks as the ring allows into one submission.
+            while (inflight < queue_depth_ && !queue_.empty()) {
+                io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+                if (sqe == nullptr) {
+                    break;
+                }
+                Chunk* chunk = queue_.front();
+                queue_.pop_front();
+                io_uring_prep_write(
+                    sqe, chunk->file->descriptor, chunk->data + chunk->written,
+                    static_cast<unsigned>(chunk->size - chunk->written),
+                    chunk->offset + static_cast<int64_t>(chunk->written));
+                io_uring_sqe_set_data(sqe, chunk);
+                ++inflight;
+                ++inflight_chunks_;
+            }
+        }
+        io_uring_submit(&ring_);
+
+        io_uring_cqe* cqe = nullptr;
+        __kernel_timespec timeout = {0, 10 * 1000 * 1000};
+        if (io_uring_wait_cqe_timeout(&ring_, &cqe, &timeout) != 0) {
+            continue;
+        }
+        unsigned head = 0;
+        unsigned completed = 0;
+        io_uring_for_each_cqe(&ring_, head, cqe) {
+            Chunk* chunk = static_cast<Chunk*>(io_uring_cqe_get_data(cqe));
+            ++completed;
+            --inflight;
+            if (cqe->res < 0) {
+                CompleteChunk(chunk, false);
+                continue;
+            }
+            chunk->written += static_cast<size_t>(cqe->res);
+            if (chunk->written < chunk->size && cqe->res > 0) {
+                // Short write: resubmit the remainder first.
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                --inflight_chunks_;
+                queue_.push_front(chunk);
+            } else {
+                CompleteChunk(chunk, chunk->written == chunk->size);
+            }
+        }
+        io_uring_cq_advance(&ring_, completed);
+    }
+#endif
+}
+
+void RTSPDiskWriter::SyncFiles(bool closing_all) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<File>> files_to_close;
+    std::vector<std::shared_ptr<File>> files_to_sync;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (auto file_entry = files_.begin(); file_entry != files_.end();) {
+            File& file = *file_entry->second;
+            if ((file.closing || closing_all) && file.pending_chunks == 0) {
+                files_to_close.push_back(file_entry->second);
+                file_entry = files_.erase(file_entry);
+                continue;
+            }
+            if (flush_policy_ == "interval" && file.dirty &&
+                now - file.last_sync >=
+                    std::chrono::milliseconds(flush_interval_ms_)) {
+                file.dirty = false;
+                file.last_sync = now;
+                files_to_sync.push_back(file_entry->second);
+            }
+            ++file_entry;
+        }
+    }
+
+    // Files are only closed by this thread, so the descriptors stay valid.
+    for (const auto& file : files_to_sync) {
+        fdatasync(file->descriptor);
+    }
+    for (const auto& file : files_to_close) {
+        if (file->direct_io && ftruncate(file->descriptor, file->size) != 0) {
+            std::cerr << "Failed to truncate " << file->path << std::endl;
+        }
+        if (flush_policy_ != "none") {
+            fsync(file->descriptor);
+        }
+        close(file->descriptor);
+    }
+}
+
+void RTSPDiskWriter::PublishMetrics(double elapsed_s) {
+    if (metrics_ == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    metrics_->SetLabel("disk_writer.backend", backend_);
+    metrics_->SetValue("disk_writer.bytes_written",
+                       static_cast<double>(bytes_written_));
+    metrics_->SetValue(
+        "disk_writer.throughput_mb_s",
+        (bytes_written_ - last_bytes_written_) / elapsed_s / (1 << 20));
+    metrics_->SetValue("disk_writer.queue_depth",
+                       static_cast<double>(queue_.size()));
+    metrics_->SetValue("disk_writer.inflight_chunks",
+                       static_cast<double>(inflight_chunks_));
+    metrics_->SetValue("disk_writer.backlog_mb",
+                       static_cast<double>(backlog_) / (1 << 20));
+    metrics_->SetValue("disk_writer.stall_time_ms", stall_time_us_ / 1000.);
+    metrics_->SetValue("disk_writer.dropped_bytes",
+                       static_cast<double>(dropped_bytes_));
+    metrics_->SetValue("disk_writer.write_errors",
+                       static_cast<double>(write_errors_));
+    metrics_->SetValue("disk_writer.open_files",
+                       static_cast<double>(files_.size()));
+    last_bytes_written_ = bytes_written_;
+}
+
+void RTSPDiskWriter::FlushLoop() {
+    auto last_report = std::chrono::steady_clock::now();
+    while (!writers_stopped_) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            flush_cv_.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        SyncFiles(false);
+
+        auto now = std::chrono::steady_clock::now();
+        double elapsed_s =
+            std::chrono::duration<double>(now - last_report).count();
+        if (elapsed_s >= 1.) {
+            PublishMetrics(elapsed_s);
+            last_report = now;
+        }
+    }
+    // All queued chunks are written once the writer threads are stopped.
+    SyncFiles(true);
+}
@@ -0,0 +1,320 @@
+#include "RTSPGovernor.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+const char* DecodeModeName(RTSPDecodeMode decode_mode) {
+    switch (decode_mode) {
+        case RTSPDecodeMode::kFull:
+            return "full";
+        case RTSPDecodeMode::kReducedRate:
+            return "reduced_rate";
+        case RTSPDecodeMode::kSparse:
+            return "sparse";
+        case RTSPDecodeMode::kPaused:
+            return "paused";
+    }
+    return "unknown";
+}
+
+}  // namespace
+
+RTSPGovernor::RTSPGovernor() {}
+
+RTSPGovernor::~RTSPGovernor() {
+    running_ = false;
+    if (govern_thread_.joinable()) {
+        govern_thread_.join();
+    }
+}
+
+void RTSPGovernor::SetCpuBudget(double cpu_budget_percent) {
+    cpu_budget_percent_ = cpu_budget_percent;
+}
+
+void RTSPGovernor::SetHysteresis(double hysteresis_percent) {
+    hysteresis_percent_ = hysteresis_percent;
+}
+
+void RTSPGovernor::SetPeriod(int period_ms) { period_ms_ = period_ms; }
+
+void RTSPGovernor::SetRestoreDelay(int restore_delay_ms) {
+    restore_delay_ms_ = restore_delay_ms;
+}
+
+void RTSPGovernor::SetMetrics(RTSPMetrics* metrics) { metrics_ = metrics; }
+
+void RTSPGovernor::AddStream(RTSPStream* stream, int priority) {
+    std::lock_guard<std::mutex> lock(streams_mutex_);
+    GovernedStream governed_stream;
+    governed_stream.stream = stream;
+    governed_stream.name = stream->GetName();
+    governed_stream.priority = priority;
+    governed_stream.decode_mode = stream->GetDecodeMode();
+    governed_stream.last_stats = stream->GetStats();
+    streams_.push_back(governed_stream);
+}
+
+void RTSPGovernor::AddStream(RTSPSupervisor* supervisor, int stream_index,
+                             const std::string& name, int priority) {
+    std::lock_guard<std::mutex> lock(streams_mutex_);
+    GovernedStream governed_stream;
+    governed_stream.supervisor = supervisor;
+    governed_stream.stream_index = stream_index;
+    governed_stream.name = name;
+    governed_stream.priority = priority;
+    governed_stream.last_stats = supervisor->GetStreamStats(stream_index);
+    supervisor->RequestDecodeMode(stream_index, RTSPDecodeMode::kFull);
+    streams_.push_back(governed_stream);
+}
+
+bool RTSPGovernor::Initialize() {
+    try {
+        if (cpu_budget_percent_ <= 0. || cpu_budget_percent_ > 100.) {
+            throw RTSPGovernorException(
+                "CPU budget must be in the (0, 100] percent range!");
+        }
+        if (hysteresis_percent_ < 0. ||
+            hysteresis_percent_ >= cpu_budget_percent_) {
+            throw RTSPGovernorException(
+                "Governor hysteresis must be less than the CPU budget!");
+        }
+        if (period_ms_ <= 0) {
+            throw RTSPGovernorException("Governor period must be positive!");
+        }
+        MeasureCpuUsage();
+        last_update_ = std::chrono::steady_clock::now();
+        running_ = true;
+        govern_thread_ = std::thread(&RTSPGovernor::GovernLoop, this);
+        std::cout << "CPU governor started with a budget of "
+                  << cpu_budget_percent_ << "%" << std::endl;
+        return true;
+    } catch (const RTSPGovernorException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
+
+double RTSPGovernor::MeasureCpuUsage() {
+    // Host-wide usage over all cores since the previous call.
+    std::ifstream proc_stat("/proc/stat");
+    std::string line;
+    if (!std::getline(proc_stat, line)) {
+        return 0.;
+    }
+    std::istringstream fields(line);
+    std::string cpu_label;
+    fields >> cpu_label;
+    uint64_t value = 0, total = 0, idle = 0;
+    for (int field = 0; fields >> value; ++field) {
+        total += value;
+        // The fourth and fifth fields are idle and iowait time.
+        if (field == 3 || field == 4) {
+            idle += value;
+        }
+    }
+    uint64_t busy = total - idle;
+    double usage = 0.;
+    if (total > last_cpu_total_ && last_cpu_total_ != 0) {
+        usage = 100. * static_cast<double>(busy - last_cpu_busy_) /
+                static_cast<double>(total - last_cpu_total_);
+    }
+    last_cpu_busy_ = busy;
+    last_cpu_total_ = total;
+    return usage;
+}
+
+RTSPStreamStats RTSPGovernor::GetStats(
+    const GovernedStream& governed_stream) {
+    if (governed_stream.supervisor != nullptr) {
+        return governed_stream.supervisor->GetStreamStats(
+            governed_stream.stream_index);
+    }
+    return governed_stream.stream->GetStats();
+}
+
+void RTSPGovernor::ApplyDecodeMode(GovernedStream& governed_stream,
+                                   RTSPDecodeMode decode_mode) {
+    governed_stream.decode_mode = decode_mode;
+    if (governed_stream.supervisor != nullptr) {
+        governed_stream.supervisor->RequestDecodeMode(
+            governed_stream.stream_index, decode_mode);
+    } else {
+        governed_stream.stream->SetDecodeMode(decode_mode);
+    }
+}
+
+bool RTSPGovernor::IsDecoding(const GovernedStream& governed_stream) {
+    if (governed_stream.supervisor != nullptr) {
+        return governed_stream.supervisor->IsDecoding(
+            governed_stream.stream_index);
+    }
+    return governed_stream.stream->IsRunning() &&
+           !governed_stream.stream->IsMemoryPaused();
+}
+
+bool RTSPGovernor::ShedsDecode(const GovernedStream& governed_stream) {
+    bool recorded = governed_stream.supervisor != nullptr
+                        ? governed_stream.supervisor->IsRecorded(
+                              governed_stream.stream_index)
+                        : governed_stream.stream->IsRecorded();
+    return !recorded && IsDecoding(governed_stream);
+}
+
+void RTSPGovernor::UpdateStreamCosts(double elapsed_us) {
+    for (auto& governed_stream : streams_) {
+        RTSPStreamStats stats = GetStats(governed_stream);
+        // A restarted worker starts its counters from zero again.
+        if (stats.grabbed_frames < governed_stream.last_stats.grabbed_frames ||
+            stats.decoded_frames < governed_stream.last_stats.decoded_frames ||
+            stats.decode_time_us < governed_stream.last_stats.decode_time_us) {
+            governed_stream.last_stats = RTSPStreamStats();
+        }
+        uint64_t grabbed = stats.grabbed_frames -
+                           governed_stream.last_stats.grabbed_frames;
+        uint64_t decoded = stats.decoded_frames -
+                           governed_stream.last_stats.decoded_frames;
+        uint64_t decode_time = stats.decode_time_us -
+                               governed_stream.last_stats.decode_time_us;
+        governed_stream.decode_us_per_frame =
+            grabbed > 0 ? static_cast<double>(decode_time) / grabbed : 0.;
+        governed_stream.decode_fps = decoded * 1e6 / elapsed_us;
+        governed_stream.decode_cpu_percent = 100. * decode_time / elapsed_us;
+        governed_stream.last_stats = stats;
+    }
+}
+
+bool RTSPGovernor::DegradeStream() {
+    // Streams that shed decoder work go first, recorded ones only save their
+    // display work.
+    GovernedStream* candidate = nullptr;
+    bool candidate_sheds = false;
+    for (auto& governed_stream : streams_) {
+        if (governed_stream.decode_mode == RTSPDecodeMode::kPaused ||
+            !IsDecoding(governed_stream)) {
+            continue;
+        }
+        bool sheds = ShedsDecode(governed_stream);
+        if (candidate == nullptr || (sheds && !candidate_sheds) ||
+            (sheds == candidate_sheds &&
+             (governed_stream.priority < candidate->priority ||
+              (governed_stream.priority == candidate->priority &&
+               governed_stream.decode_cpu_percent >
+                   candidate->decode_cpu_percent)))) {
+            candidate = &governed_stream;
+            candidate_sheds = sheds;
+        }
+    }
+    if (candidate == nullptr) {
+        return false;
+    }
+    auto decode_mode = static_cast<RTSPDecodeMode>(
+        static_cast<int>(candidate->decode_mode) + 1);
+    ApplyDecodeMode(*candidate, decode_mode);
+    last_decision_ = "degrade " + candidate->name + " to " +
+                     DecodeModeName(decode_mode) +
+                     (candidate_sheds ? "" : ", display only");
+    std::cout << "CPU governor: " << last_decision_ << std::endl;
+    return true;
+}
+
+bool RTSPGovernor::RestoreStream() {
+    // The reverse order: streams whose degradation only saved display work
+    // come back first.
+    GovernedStream* candidate = nullptr;
+    bool candidate_sheds = false;
+    for (auto& governed_stream : streams_) {
+        if (governed_stream.decode_mode == RTSPDecodeMode::kFull) {
+            continue;
+        }
+        bool sheds = ShedsDecode(governed_stream);
+        if (candidate == nullptr || (!sheds && candidate_sheds) ||
+            (sheds == candidate_sheds &&
+             (governed_stream.priority > candidate->priority ||
+              (governed_stream.priority == candidate->priority &&
+               governed_stream.decode_us_per_frame <
+                   candidate->decode_us_per_frame)))) {
+            candidate = &governed_stream;
+            candidate_sheds = sheds;
+        }
+    }
+    if (candidate == nullptr) {
+        return false;
+    }
+    auto decode_mode = static_cast<RTSPDecodeMode>(
+        static_cast<int>(candidate->decode_mode) - 1);
+    ApplyDecodeMode(*candidate, decode_mode);
+    last_decision_ = "restore " + candidate->name + " to " +
+                     DecodeModeName(decode_mode);
+    std::cout << "CPU governor: " << last_decision_ << std::endl;
+    return true;
+}
+
+void RTSPGovernor::PublishMetrics(double cpu_usage) {
+    if (metrics_ == nullptr) {
+        return;
+    }
+    int degraded_streams = 0;
+    for (const auto& governed_stream : streams_) {
+        RTSPDecodeMode decode_mode = governed_stream.decode_mode;
+        if (decode_mode != RTSPDecodeMode::kFull) {
+            ++degraded_streams;
+        }
+        std::string prefix = "streams." + governed_stream.name + ".";
+        metrics_->SetValue(prefix + "priority", governed_stream.priority);
+        metrics_->SetValue(prefix + "sheds_decode",
+                           ShedsDecode(governed_stream) ? 1 : 0);
+        metrics_->SetLabel(prefix + "decode_mode", DecodeModeName(decode_mode));
+        metrics_->SetValue(prefix + "decode_us_per_frame",
+                           governed_stream.decode_us_per_frame);
+        metrics_->SetValue(prefix + "decode_fps", governed_stream.decode_fps);
+        metrics_->SetValue(prefix + "decode_cpu_percent",
+                           governed_stream.decode_cpu_percent);
+    }
+    metrics_->SetValue("governor.cpu_percent", cpu_usage);
+    metrics_->SetValue("governor.cpu_budget_percent", cpu_budget_percent_);
+    metrics_->SetValue("governor.degraded_streams", degraded_streams);
+    metrics_->SetLabel("governor.last_decision", last_decision_);
+}
+
+void RTSPGovernor::GovernLoop() {
+    while (running_) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(period_ms_));
+
+        auto now = std::chrono::steady_clock::now();
+        double elapsed_us = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                now - last_update_)
+                .count());
+        last_update_ = now;
+        double cpu_usage = MeasureCpuUsage();
+
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        if (elapsed_us > 0.) {
+            UpdateStreamCosts(elapsed_us);
+        }
+
+        if (cpu_usage > cpu_budget_percent_) {
+            below_budget_ = false;
+            DegradeStream();
+        } else if (cpu_usage < cpu_budget_percent_ - hysteresis_percent_) {
+            if (!below_budget_) {
+                below_budget_ = true;
+                below_budget_since_ = now;
+            } else if (now - below_budget_since_ >=
+                       std::chrono::milliseconds(restore_delay_ms_)) {
+                // Restart the delay so every restore step is observed before
+                // the next one.
+                RestoreStream();
+                below_budget_since_ = now;
+            }
+        } else {
+            below_budget_ = false;
+        }
+
+        PublishMetrics(cpu_usage);
+    }
+}
@@ -0,0 +1,423 @@
+#include "RTSPMemoryManager.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+namespace {
+
+// Reference frames and reorder delay an H.264/H.265 decoder keeps, plus the
+// frames in flight between threads.
+const size_t kDecoderSurfaces = 8;
+// Lookahead and B-frame surfaces of a typical software encoder.
+const size_t kEncoderSurfaces = 16;
+// Decoded frames are shrunk at most by 2^kMaxDownscaleLevel.
+const int kMaxDownscaleLevel = 2;
+// The disk writer backlog is shrunk at most to this fraction.
+const size_t kMinBacklogDivider = 8;
+
+double ToMb(size_t bytes) {
+    return static_cast<double>(bytes) / (1024. * 1024.);
+}
+
+// Bytes of one decoded BGR frame at the given downscale factor.
+size_t FrameBytes(const cv::Size& size, int downscale) {
+    size_t area = static_cast<size_t>(size.width / downscale) *
+                  static_cast<size_t>(size.height / downscale);
+    return area * 3;
+}
+
+}  // namespace
+
+RTSPMemoryManager::RTSPMemoryManager() {}
+
+RTSPMemoryManager::~RTSPMemoryManager() {
+    running_ = false;
+    if (manage_thread_.joinable()) {
+        manage_thread_.join();
+    }
+}
+
+void RTSPMemoryManager::SetMemoryCap(size_t memory_cap) {
+    memory_cap_ = memory_cap;
+}
+
+void RTSPMemoryManager::SetHysteresis(double hysteresis_percent) {
+    hysteresis_percent_ = hysteresis_percent;
+}
+
+void RTSPMemoryManager::SetPeriod(int period_ms) { period_ms_ = period_ms; }
+
+void RTSPMemoryManager::SetRestoreDelay(int restore_delay_ms) {
+    restore_delay_ms_ = restore_delay_ms;
+}
+
+void RTSPMemoryManager::SetMetrics(RTSPMetrics* metrics) {
+    metrics_ = metrics;
+}
+
+void RTSPMemoryManager::AddStream(RTSPStream* stream, int priority) {
+    std::lock_guard<std::mutex> lock(manager_mutex_);
+    ManagedStream managed_stream;
+    managed_stream.stream = stream;
+    managed_stream.priority = priority;
+    // Sync groups size the history before the stream is registered.
+    managed_stream.original_history_depth = stream->GetHistoryDepth();
+    streams_.push_back(managed_stream);
+}
+
+void RTSPMemoryManager::AddRecorder(RTSPRecorder* recorder,
+                                    const std::string& owner) {
+    std::lock_guard<std::mutex> lock(manager_mutex_);
+    recorders_.push_back({recorder, owner});
+}
+
+void RTSPMemoryManager::SetDiskWriter(RTSPDiskWriter* disk_writer) {
+    std::lock_guard<std::mutex> lock(manager_mutex_);
+    disk_writer_ = disk_writer;
+    original_backlog_ = disk_writer != nullptr ? disk_writer->GetMaxBacklog()
+                                               : 0;
+}
+
+void RTSPMemoryManager::ReportUsage(const std::string& subsystem,
+                                    size_t bytes) {
+    std::lock_guard<std::mutex> lock(manager_mutex_);
+    reported_usage_[subsystem] = bytes;
+}
+
+bool RTSPMemoryManager::Initialize() {
+    try {
+        if (memory_cap_ == 0) {
+            throw RTSPMemoryManagerException("Memory cap must be positive!");
+        }
+        if (hysteresis_percent_ < 0. || hysteresis_percent_ >= 100.) {
+            throw RTSPMemoryManagerException(
+                "Memory hysteresis must be in the [0, 100) percent range!");
+        }
+        if (period_ms_ <= 0) {
+            throw RTSPMemoryManagerException(
+                "Memory manager period must be positive!");
+        }
+        running_ = true;
+        manage_thread_ = std::thread(&RTSPMemoryManager::ManageLoop, this);
+        std::cout << "Memory manager started with a cap of "
+                  << ToMb(memory_cap_) << " MB" << std::endl;
+        return true;
+    } catch (const RTSPMemoryManagerException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
+
+size_t RTSPMemoryManager::EstimateDecoderMemory(const cv::Size& size) {
+    size_t area = static_cast<size_t>(size.area());
+    // YUV 4:2:0 surfaces plus the BGR conversion buffer of the backend.
+    return area * 3 / 2 * kDecoderSurfaces + area * 3;
+}
+
+size_t RTSPMemoryManager::EstimateEncoderMemory(const cv::Size& size) {
+    return static_cast<size_t>(size.area()) * 3 / 2 * kEncoderSurfaces;
+}
+
+size_t RTSPMemoryManager::Account() {
+    subsystems_.clear();
+    subsystems_["capture"] = 0;
+    subsystems_["decoder"] = 0;
+    subsystems_["recorders"] = 0;
+    subsystems_["encoder"] = 0;
+    subsystems_["disk_writer"] = 0;
+    for (auto& managed_stream : streams_) {
+        RTSPStream* stream = managed_stream.stream;
+        managed_stream.frame_bytes = stream->GetMemoryUsage();
+        managed_stream.decoder_bytes =
+            stream->IsConnected()
+                ? EstimateDecoderMemory(stream->GetFrameSize())
+                : 0;
+        managed_stream.recorder_bytes = 0;
+        subsystems_["capture"] += managed_stream.frame_bytes;
+        subsystems_["decoder"] += managed_stream.decoder_bytes;
+    }
+    for (const auto& managed_recorder : recorders_) {
+        size_t recorder_bytes = managed_recorder.recorder->GetMemoryUsage();
+        subsystems_["recorders"] += recorder_bytes;
+        // Nothing is encoded before the first frame arrives.
+        if (recorder_bytes > 0) {
+            subsystems_["encoder"] += EstimateEncoderMemory(
+                managed_recorder.recorder->GetFrameSize());
+        }
+        for (auto& managed_stream : streams_) {
+            if (managed_stream.stream->GetName() == managed_recorder.owner) {
+                managed_stream.recorder_bytes += recorder_bytes;
+            }
+        }
+    }
+    if (disk_writer_ != nullptr) {
+        subsystems_["disk_writer"] = disk_writer_->GetMemoryUsage();
+    }
+    for (const auto& [subsystem, bytes] : reported_usage_) {
+        subsystems_[subsystem] += bytes;
+    }
+
+    size_t total = 0;
+    for (const auto& [subsystem, bytes] : subsystems_) {
+        total += bytes;
+    }
+    return total;
+}
+
+bool RTSPMemoryManager::Shrink() {
+    // Older frames only serve the cross-camera alignment, so they go first.
+    ManagedStream* candidate = nullptr;
+    for (auto& managed_stream : streams_) {
+        if (managed_stream.stream->GetHistoryDepth() > 1 &&
+            (candidate == nullptr ||
+             managed_stream.priority < candidate->priority)) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        int history_depth = candidate->stream->GetHistoryDepth() / 2;
+        candidate->stream->SetHistoryDepth(history_depth);
+        last_decision_ = "shrink " + candidate->stream->GetName() +
+                         " history to " + std::to_string(history_depth);
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    // A smaller backlog only drops recording data under a disk stall. It
+    // always keeps room for one chunk, or nothing would be written at all.
+    size_t min_backlog =
+        disk_writer_ != nullptr
+            ? std::max(original_backlog_ / kMinBacklogDivider,
+                       disk_writer_->GetChunkSize())
+            : 0;
+    if (disk_writer_ != nullptr &&
+        disk_writer_->GetMaxBacklog() > min_backlog) {
+        size_t max_backlog =
+            std::max(disk_writer_->GetMaxBacklog() / 2, min_backlog);
+        disk_writer_->SetMaxBacklog(max_backlog);
+        last_decision_ = "shrink disk writer backlog to " +
+                         std::to_string(max_backlog >> 20) + " MB";
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    for (auto& managed_stream : streams_) {
+        if (managed_stream.downscale_level < kMaxDownscaleLevel &&
+            !managed_stream.stream->IsRecorded() &&
+            (candidate == nullptr ||
+             managed_stream.priority < candidate->priority ||
+             (managed_stream.priority == candidate->priority &&
+              managed_stream.downscale_level < candidate->downscale_level))) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        // Halving the factor quarters the held frames; the decoder surfaces
+        // keep the stream resolution.
+        size_t saving = candidate->frame_bytes - candidate->frame_bytes / 4;
+        int downscale = 1 << ++candidate->downscale_level;
+        candidate->stream->SetDownscale(downscale);
+        last_decision_ = "downscale " + candidate->stream->GetName() +
+                         " by " + std::to_string(downscale) + ", saving " +
+                         std::to_string(saving >> 20) + " MB";
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    // The decoder surfaces are only freed by closing the decoder.
+    for (auto& managed_stream : streams_) {
+        if (!managed_stream.paused && managed_stream.decoder_bytes > 0 &&
+            !managed_stream.stream->IsRecorded() &&
+            (candidate == nullptr ||
+             managed_stream.priority < candidate->priority)) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        candidate->paused = true;
+        candidate->stream->SetMemoryPaused(true);
+        last_decision_ = "pause " + candidate->stream->GetName() +
+                         ", saving " +
+                         std::to_string(candidate->decoder_bytes >> 20) +
+                         " MB";
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+    // Logged once, the cap stays exceeded until usage drops.
+    if (last_decision_ != "nothing left to shrink") {
+        last_decision_ = "nothing left to shrink";
+        std::cerr << "Memory manager: " << last_decision_ << std::endl;
+    }
+    return false;
+}
+
+bool RTSPMemoryManager::Restore(size_t total, size_t restore_limit) {
+    // Undo the shrink steps in the reverse order. Every step is only taken
+    // when its estimated cost still fits, so restoring can not push the
+    // total back over the cap.
+    ManagedStream* candidate = nullptr;
+    for (auto& managed_stream : streams_) {
+        if (managed_stream.paused &&
+            (candidate == nullptr ||
+             managed_stream.priority > candidate->priority)) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        size_t cost =
+            EstimateDecoderMemory(candidate->stream->GetFrameSize());
+        if (total + cost >= restore_limit) {
+            return false;
+        }
+        candidate->paused = false;
+        candidate->stream->SetMemoryPaused(false);
+        last_decision_ = "resume " + candidate->stream->GetName();
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    for (auto& managed_stream : streams_) {
+        if (managed_stream.downscale_level > 0 &&
+            (candidate == nullptr ||
+             managed_stream.priority > candidate->priority)) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        // Halving the factor quadruples the decoded frames. Recorded streams
+        // are never downscaled, so no recorder buffer grows with them.
+        size_t cost = 3 * candidate->frame_bytes;
+        if (total + cost >= restore_limit) {
+            return false;
+        }
+        int downscale = 1 << --candidate->downscale_level;
+        candidate->stream->SetDownscale(downscale);
+        last_decision_ = "restore " + candidate->stream->GetName() +
+                         " downscale to " + std::to_string(downscale);
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    if (disk_writer_ != nullptr &&
+        disk_writer_->GetMaxBacklog() < original_backlog_) {
+        size_t max_backlog =
+            std::min(original_backlog_, disk_writer_->GetMaxBacklog() * 2);
+        if (total + max_backlog - disk_writer_->GetMaxBacklog() >=
+            restore_limit) {
+            return false;
+        }
+        disk_writer_->SetMaxBacklog(max_backlog);
+        last_decision_ = "restore disk writer backlog to " +
+                         std::to_string(max_backlog >> 20) + " MB";
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+
+    for (auto& managed_stream : streams_) {
+        if (managed_stream.stream->GetHistoryDepth() <
+                managed_stream.original_history_depth &&
+            (candidate == nullptr ||
+             managed_stream.priority > candidate->priority)) {
+            candidate = &managed_stream;
+        }
+    }
+    if (candidate != nullptr) {
+        int history_depth = candidate->stream->GetHistoryDepth();
+        int restored_depth = std::min(candidate->original_history_depth,
+                                      std::max(1, history_depth * 2));
+        size_t cost = static_cast<size_t>(restored_depth - history_depth) *
+                      FrameBytes(candidate->stream->GetFrameSize(),
+                                 candidate->stream->GetDownscale());
+        if (total + cost >= restore_limit) {
+            return false;
+        }
+        candidate->stream->SetHistoryDepth(restored_depth);
+        last_decision_ = "restore " + candidate->stream->GetName() +
+                         " history to " + std::to_string(restored_depth);
+        std::cout << "Memory manager: " << last_decision_ << std::endl;
+        return true;
+    }
+    return false;
+}
+
+size_t RTSPMemoryManager::ReadResidentMemory() {
+    // The second field is the resident set in pages.
+    std::ifstream proc_statm("/proc/self/statm");
+    size_t total_pages = 0, resident_pages = 0;
+    if (!(proc_statm >> total_pages >> resident_pages)) {
+        return 0;
+    }
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void RTSPMemoryManager::PublishMetrics(size_t total) {
+    if (metrics_ == nullptr) {
+        return;
+    }
+    for (const auto& managed_stream : streams_) {
+        std::string prefix =
+            "streams." + managed_stream.stream->GetName() + ".memory.";
+        metrics_->SetValue(prefix + "frames_mb",
+                           ToMb(managed_stream.frame_bytes));
+        metrics_->SetValue(prefix + "decoder_mb",
+                           ToMb(managed_stream.decoder_bytes));
+        metrics_->SetValue(prefix + "recorder_mb",
+                           ToMb(managed_stream.recorder_bytes));
+        metrics_->SetValue(prefix + "history_depth",
+                           managed_stream.stream->GetHistoryDepth());
+        metrics_->SetValue(prefix + "downscale",
+                           managed_stream.stream->GetDownscale());
+        metrics_->SetValue(prefix + "paused", managed_stream.paused ? 1 : 0);
+    }
+    for (const auto& [subsystem, bytes] : subsystems_) {
+        metrics_->SetValue("memory.subsystems." + subsystem + "_mb",
+                           ToMb(bytes));
+    }
+    // Heap overhead, code and buffers outside the accounting.
+    size_t resident = ReadResidentMemory();
+    metrics_->SetValue("memory.total_mb", ToMb(total));
+    metrics_->SetValue("memory.cap_mb", ToMb(memory_cap_));
+    metrics_->SetValue("memory.rss_mb", ToMb(resident));
+    metrics_->SetValue("memory.unaccounted_mb",
+                       resident > total ? ToMb(resident - total) : 0.);
+    metrics_->SetValue("memory.shrink_steps", shrink_steps_);
+    metrics_->SetLabel("memory.last_decision", last_decision_);
+}
+
+void RTSPMemoryManager::ManageLoop() {
+    while (running_) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(period_ms_));
+
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(manager_mutex_);
+        size_t total = Account();
+        size_t restore_limit = static_cast<size_t>(
+            static_cast<double>(memory_cap_) *
+            (1. - hysteresis_percent_ / 100.));
+
+        // One step per period, so its effect is accounted before the next.
+        if (total > memory_cap_) {
+            below_cap_ = false;
+            if (Shrink()) {
+                ++shrink_steps_;
+            }
+        } else if (total < restore_limit && shrink_steps_ > 0) {
+            if (!below_cap_) {
+                below_cap_ = true;
+                below_cap_since_ = now;
+            } else if (now - below_cap_since_ >=
+                       std::chrono::milliseconds(restore_delay_ms_)) {
+                if (Restore(total, restore_limit)) {
+                    --shrink_steps_;
+                }
+                below_cap_since_ = now;
+            }
+        } else {
+            below_cap_ = false;
+        }
+
+        PublishMetrics(total);
+    }
+}
@@ -0,0 +1,147 @@
+#include "RTSPMetrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+RTSPMetrics::RTSPMetrics() {}
+
+RTSPMetrics::~RTSPMetrics() {
+    running_ = false;
+    if (report_thread_.joinable()) {
+        report_thread_.join();
+        WriteSnapshot();
+    }
+}
+
+void RTSPMetrics::SetOutputPath(const std::string& output_path) {
+    output_path_ = output_path;
+}
+
+void RTSPMetrics::SetReportPeriod(int report_period_ms) {
+    report_period_ms_ = report_period_ms;
+}
+
+bool RTSPMetrics::Initialize() {
+    try {
+        if (report_period_ms_ <= 0) {
+            throw RTSPMetricsException("Metrics report period must be "
+                                       "positive!");
+        }
+        if (output_path_.empty()) {
+            std::cout << "Metrics output path is not set. Metrics are only "
+                      << "collected in memory." << std::endl;
+            return true;
+        }
+        running_ = true;
+        report_thread_ = std::thread(&RTSPMetrics::ReportLoop, this);
+        return true;
+    } catch (const RTSPMetricsException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
+
+void RTSPMetrics::SetValue(const std::string& name, double value) {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    values_[name] = value;
+}
+
+void RTSPMetrics::SetLabel(const std::string& name, const std::string& value) {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    values_[name] = value;
+}
+
+void RTSPMetrics::AddToCounter(const std::string& name, double delta) {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    auto& counter = values_[name];
+    if (counter.is_number()) {
+        counter = counter.get<double>() + delta;
+    } else {
+        counter = delta;
+    }
+}
+
+void RTSPMetrics::MergeSnapshot(const std::string& prefix,
+                                const nlohmann::json& snapshot) {
+    // Snapshots of other registries, e.g. forwarded by worker processes, are
+    // flattened back into dotted names below the prefix.
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    MergeValues(prefix, snapshot);
+}
+
+void RTSPMetrics::MergeValues(const std::string& name,
+                              const nlohmann::json& value) {
+    if (!value.is_object()) {
+        if (!name.empty()) {
+            values_[name] = value;
+        }
+        return;
+    }
+    for (const auto& [key, child] : value.items()) {
+        MergeValues(name.empty() ? key : name + "." + key, child);
+    }
+}
+
+nlohmann::json RTSPMetrics::GetSnapshot() {
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    nlohmann::json snapshot = nlohmann::json::object();
+    for (const auto& [name, value] : values_) {
+        // Stream names may contain the JSON pointer special characters.
+        std::string pointer = "/";
+        for (char symbol : name) {
+            if (symbol == '.') {
+                pointer += '/';
+            } else if (symbol == '~') {
+                pointer += "~0";
+            } else if (symbol == '/') {
+                pointer += "~1";
+            } else {
+                pointer += symbol;
+            }
+        }
+        try {
+            snapshot[nlohmann::json::json_pointer(pointer)] = value;
+        } catch (const nlohmann::json::exception& e) {
+            // A value and a block with the same name, e.g. "a.b" and
+            // "a.b.c", can not both be nested; the later one is dropped.
+            std::cerr << "Failed to report metric " << name << ": "
+                      << e.what() << std::endl;
+        }
+    }
+    return snapshot;
+}
+
+void RTSPMetrics::WriteSnapshot() {
+    // Write to a temporary file first so readers never see a partial report.
+    std::string temporary_path = output_path_ + ".tmp";
+    {
+        std::ofstream output(temporary_path, std::ios::trunc);
+        if (!output.is_open()) {
+            std::cerr << "Failed to write metrics to " << output_path_
+                      << std::endl;
+            return;
+        }
+        try {
+            output << GetSnapshot().dump(4) << std::endl;
+        } catch (const nlohmann::json::exception& e) {
+            // E.g. a label that is not valid UTF-8.
+            std::cerr << "Failed to write metrics: " << e.what() << std::endl;
+            return;
+        }
+    }
+    std::rename(temporary_path.c_str(), output_path_.c_str());
+}
+
+void RTSPMetrics::ReportLoop() {
+    while (running_) {
+        auto iteration_start = std::chrono::steady_clock::now();
+        WriteSnapshot();
+        auto next_report =
+            iteration_start + std::chrono::milliseconds(report_period_ms_);
+        while (running_ && std::chrono::steady_clock::now() < next_report) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+}
@@ -1,15 +1,45 @@
 #include "RTSPRecorder.hpp"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// OpenCV's FFmpeg writer emits an intra frame every 12 frames by default,
+// starting with the first frame of a file. It can not be configured nor
+// queried through cv::VideoWriter, so the index only estimates keyframes.
+const uint32_t kEstimatedWriterGopSize = 12;
+
+const int64_t kMotionMarkerPeriodMs = 1000;
+
+const size_t kPumpBufferSize = 256 * 1024;
+const int kPipeSize = 1 << 20;
+
+int64_t WallNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+}  // namespace
+
 RTSPRecorder::RTSPRecorder() {}
 
 RTSPRecorder::~RTSPRecorder() {
     connected_ = false;
     if (capture_thread_.joinable()) {
         capture_thread_.join();
-        if (!video_writer_.isOpened()) {
-            video_writer_.release();
-        }
     }
+    CloseSegment();
 };
 
 void RTSPRecorder::SetOutputPath(const std::string& output) {
@@ -22,6 +52,24 @@ void RTSPRecorder::SetFrameSize(const cv::Size& frame_size) {
     frame_size_ = frame_size;
 }
 
+void RTSPRecorder::SetSegmentDuration(int segment_duration_s) {
+    segment_duration_s_ = segment_duration_s;
+}
+
+void RTSPRecorder::SetContainer(const std::string& container) {
+    container_ = container;
+}
+
+void RTSPRecorder::SetMotionThreshold(double motion_threshold) {
+    motion_threshold_ = motion_threshold;
+}
+
+void RTSPRecorder::SetDiskWriter(RTSPDiskWriter* disk_writer) {
+    disk_writer_ = disk_writer;
+}
+
+void RTSPRecorder::SetWallMode(bool wall_mode) { wall_mode_ = wall_mode; }
+
 bool RTSPRecorder::Initialize() {
     try {
         if (output_path_.empty()) {
@@ -33,14 +81,23 @@ bool RTSPRecorder::Initialize() {
         if (frame_size_ == cv::Size(0, 0)) {
             throw RTSPRecorderException("Frame size is not set!");
         }
-        video_writer_.open(output_path_,
-                           cv::VideoWriter::fourcc('a', 'v', 'c', '1'),
-                           target_fps_, frame_size_);
-        if (!video_writer_.isOpened()) {
+        if (segment_duration_s_ <= 0) {
+            throw RTSPRecorderException("Segment duration must be positive!");
+        }
+        if (disk_writer_ != nullptr && container_ == "mp4") {
+            // MP4 rewrites its header at the end and needs a seekable output.
+            std::cout << "WARNING: mp4 segments can not be written through "
+                      << "the disk writer, using ts instead." << std::endl;
+            container_ = "ts";
+        }
+        std::filesystem::create_directories(output_path_);
+        if (!OpenSegment()) {
             throw RTSPRecorderException("failed to create a video recorder!");
         }
-        capture_thread_ = std::thread(&RTSPRecorder::RecordLoop, this);
         connected_ = true;
+        capture_thread_ =
+            wall_mode_ ? std::thread(&RTSPRecorder::WallRecordLoop, this)
+                       : std::thread(&RTSPRecorder::RecordLoop, this);
         return connected_;
     } catch (const RTSPRecorderException& e) {
         std::cerr << e.what() << std::endl;
@@ -50,27 +107,275 @@ bool RTSPRecorder::Initialize() {
     return false;
 }
 
+bool RTSPRecorder::OpenSegment() {
+    segment_start_ms_ = WallNowMs();
+    segment_frames_ = 0;
+    std::string segment_path = output_path_ + "/" +
+                               std::to_string(segment_start_ms_) + "." +
+                               container_;
+    std::string writer_path = segment_path;
+    if (disk_writer_ != nullptr) {
+        // The FIFO keeps the container extension so the encoder picks the
+        // right muxer.
+        writer_path = output_path_ + "/" + std::to_string(segment_start_ms_) +
+                      ".pipe." + container_;
+        if (mkfifo(writer_path.c_str(), 0600) != 0) {
+            std::cerr << "Failed to create FIFO " << writer_path << ": "
+                      << std::strerror(errno) << std::endl;
+            return false;
+        }
+        int handle = disk_writer_->Open(segment_path);
+        if (handle < 0) {
+            unlink(writer_path.c_str());
+            return false;
+        }
+        pump_thread_ =
+            std::thread(&RTSPRecorder::PumpLoop, this, writer_path, handle);
+    }
+
+    video_writer_.open(writer_path,
+                       cv::VideoWriter::fourcc('a', 'v', 'c', '1'),
+                       target_fps_, frame_size_);
+    if (!video_writer_.isOpened()) {
+        std::cerr << "Failed to open segment " << segment_path << std::endl;
+        if (pump_thread_.joinable()) {
+            // Release the pump thread waiting for a writer on the FIFO. The
+            // open fails with ENXIO until the pump has opened its end and
+            // with ENOENT once it already got a writer and unlinked the FIFO.
+            int descriptor = -1;
+            while ((descriptor = open(writer_path.c_str(),
+                                      O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0 &&
+                   errno == ENXIO) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (descriptor >= 0) {
+                close(descriptor);
+            }
+            pump_thread_.join();
+        }
+        return false;
+    }
+    index_file_.open(segment_path + ".idx", std::ios::binary | std::ios::trunc);
+    if (!index_file_.is_open()) {
+        std::cerr << "Failed to open index of segment " << segment_path
+                  << std::endl;
+        CloseSegment();
+        return false;
+    }
+    return true;
+}
+
+void RTSPRecorder::CloseSegment() {
+    if (video_writer_.isOpened()) {
+        video_writer_.release();
+    }
+    // Releasing the encoder closes the FIFO, which ends the pump.
+    if (pump_thread_.joinable()) {
+        pump_thread_.join();
+    }
+    if (index_file_.is_open()) {
+        index_file_.close();
+    }
+}
+
+void RTSPRecorder::PumpLoop(std::string fifo_path, int handle) {
+    int descriptor = open(fifo_path.c_str(), O_RDONLY | O_CLOEXEC);
+    unlink(fifo_path.c_str());
+    if (descriptor < 0) {
+        std::cerr << "Failed to open FIFO " << fifo_path << ": "
+                  << std::strerror(errno) << std::endl;
+        disk_writer_->Close(handle);
+        return;
+    }
+    fcntl(descriptor, F_SETPIPE_SZ, kPipeSize);
+
+    std::vector<char> buffer(kPumpBufferSize);
+    while (true) {
+        ssize_t result = read(descriptor, buffer.data(), buffer.size());
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        disk_writer_->Write(handle, buffer.data(),
+                            static_cast<size_t>(result));
+    }
+    close(descriptor);
+    disk_writer_->Close(handle);
+}
+
+void RTSPRecorder::WriteIndexRecord(uint32_t flags) {
+    RTSPIndexRecord record;
+    record.wall_time_ms = WallNowMs();
+    record.media_time_ms =
+        static_cast<int64_t>(segment_frames_) * 1000 / target_fps_;
+    record.frame_number = segment_frames_;
+    record.flags = flags;
+    index_file_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    // Keep the index usable for export while the segment is still recorded.
+    index_file_.flush();
+}
+
+bool RTSPRecorder::DetectMotion(const cv::Mat& frame) {
+    if (motion_threshold_ <= 0.) {
+        return false;
+    }
+    cv::Mat thumbnail;
+    cv::resize(frame, thumbnail, cv::Size(32, 18), 0, 0, cv::INTER_AREA);
+    cv::cvtColor(thumbnail, thumbnail, cv::COLOR_BGR2GRAY);
+    bool motion = false;
+    if (!motion_reference_.empty()) {
+        double difference = cv::norm(thumbnail, motion_reference_,
+                                     cv::NORM_L1) /
+                            static_cast<double>(thumbnail.total());
+        int64_t now = WallNowMs();
+        if (difference > motion_threshold_ &&
+            now - last_motion_ms_ >= kMotionMarkerPeriodMs) {
+            last_motion_ms_ = now;
+            motion = true;
+        }
+    }
+    motion_reference_ = thumbnail;
+    return motion;
+}
+
 void RTSPRecorder::SetFrame(const cv::Mat& frame) {
+    // Double buffered: the frame is copied into the back buffer, which keeps
+    // its allocation between frames, and encoded from the front buffer
+    // without holding the lock.
     std::lock_guard<std::mutex> lock(frame_mutex_);
-    frame_ = frame.clone();
+    frame.copyTo(frame_);
+    frame_pending_ = true;
+}
+
+void RTSPRecorder::MarkEvent() { event_pending_ = true; }
+
+cv::Size RTSPRecorder::GetFrameSize() { return frame_size_; }
+
+size_t RTSPRecorder::GetMemoryUsage() {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    // The front buffer owned by the record thread has the same size.
+    size_t bytes = 2 * frame_.total() * frame_.elemSize();
+    if (!frame_.empty() && frame_.size() != frame_size_) {
+        bytes += static_cast<size_t>(frame_size_.area()) * frame_.elemSize();
+    }
+    return bytes;
 }
 
 void RTSPRecorder::RecordLoop() {
+    const int64_t frame_period_us = 1000000 / target_fps_;
+    const uint32_t segment_frames =
+        static_cast<uint32_t>(segment_duration_s_ * target_fps_);
     while (connected_) {
         auto iteration_start = std::chrono::high_resolution_clock::now();
-        if (video_writer_.isOpened()) {
+        {
+            // Only the swap is done under the lock, so encoding and segment
+            // rotation never stall the loop that feeds the frames.
             std::lock_guard<std::mutex> lock(frame_mutex_);
-            video_writer_.write(frame_);
-        } else {
+            if (frame_pending_) {
+                std::swap(frame_, front_frame_);
+                frame_pending_ = false;
+            }
+        }
+        if (segment_frames_ >= segment_frames) {
+            CloseSegment();
+            OpenSegment();
+        }
+        if (!video_writer_.isOpened()) {
             connected_ = false;
+        } else if (!front_frame_.empty()) {
+            // The last frame is repeated until a new one arrives. The writer
+            // drops frames that do not match its frame size, e.g. after a
+            // camera changes resolution on reconnect.
+            const cv::Mat* frame = &front_frame_;
+            if (front_frame_.size() != frame_size_) {
+                cv::resize(front_frame_, resized_frame_, frame_size_);
+                frame = &resized_frame_;
+            }
+
+            uint32_t flags = 0;
+            if (segment_frames_ % kEstimatedWriterGopSize == 0) {
+                flags |= kIndexEstimatedKeyframe;
+            }
+            if (event_pending_.exchange(false)) {
+                flags |= kIndexEvent;
+            }
+            if (DetectMotion(*frame)) {
+                flags |= kIndexMotion;
+            }
+            video_writer_.write(*frame);
+            if (flags != 0) {
+                WriteIndexRecord(flags);
+            }
+            ++segment_frames_;
         }
         auto iteration_end = std::chrono::high_resolution_clock::now();
         auto iteration_duration =
             std::chrono::duration_cast<std::chrono::microseconds>(
                 iteration_end - iteration_start);
-        if (iteration_duration.count() < 50000) {
+        if (iteration_duration.count() < frame_period_us) {
             std::this_thread::sleep_for(std::chrono::microseconds(
-                50000 - iteration_duration.count()));  // ~20 FPS
+                frame_period_us - iteration_duration.count()));
         }
     }
-}
\ No newline at end of file
+}
+
+void RTSPRecorder::WallRecordLoop() {
+    const int64_t frame_period_us = 1000000 / target_fps_;
+    const int64_t segment_duration_ms =
+        static_cast<int64_t>(segment_duration_s_) * 1000;
+    while (connected_) {
+        auto iteration_start = std::chrono::high_resolution_clock::now();
+        bool frame_pending = false;
+        {
+            std::lock_guard<std::mutex> lock(frame_mutex_);
+            if (frame_pending_) {
+                std::swap(frame_, front_frame_);
+                frame_pending_ = false;
+                frame_pending = true;
+            }
+        }
+        // The compositor keeps drawing into the back buffer while the front
+        // one is encoded; unchanged walls cost nothing.
+        if (frame_pending) {
+            // Segments are rotated on wall time, as skipped frames make the
+            // frame count lag behind.
+            if (WallNowMs() - segment_start_ms_ >= segment_duration_ms) {
+                CloseSegment();
+                OpenSegment();
+            }
+            if (!video_writer_.isOpened()) {
+                connected_ = false;
+                break;
+            }
+            const cv::Mat* frame = &front_frame_;
+            if (front_frame_.size() != frame_size_) {
+                cv::resize(front_frame_, resized_frame_, frame_size_);
+                frame = &resized_frame_;
+            }
+
+            uint32_t flags = kIndexFrame;
+            if (segment_frames_ % kEstimatedWriterGopSize == 0) {
+                flags |= kIndexEstimatedKeyframe;
+            }
+            if (event_pending_.exchange(false)) {
+                flags |= kIndexEvent;
+            }
+            if (DetectMotion(*frame)) {
+                flags |= kIndexMotion;
+            }
+            video_writer_.write(*frame);
+            WriteIndexRecord(flags);
+            ++segment_frames_;
+        }
+        auto iteration_end = std::chrono::high_resolution_clock::now();
+        auto iteration_duration =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                iteration_end - iteration_start);
+        if (iteration_duration.count() < frame_period_us) {
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                frame_period_us - iteration_duration.count()));
+        }
+    }
+}
@@ -0,0 +1,283 @@
+#include "RTSPSharedFrames.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+namespace {
+
+const uint32_t kSegmentMagic = 0x52545350;  // "RTSP"
+const size_t kAlignment = 64;
+
+size_t Align(size_t size) {
+    return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+int64_t SteadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t WorkersOffset() { return Align(sizeof(uint64_t) * 8); }
+
+size_t StreamsOffset(int worker_count) {
+    return WorkersOffset() +
+           worker_count * Align(sizeof(RTSPSharedWorkerHeader));
+}
+
+}  // namespace
+
+RTSPSharedFrames::RTSPSharedFrames() {}
+
+RTSPSharedFrames::~RTSPSharedFrames() { Close(); }
+
+bool RTSPSharedFrames::Create(const std::string& name, int worker_count,
+                              int stream_count, const cv::Size& tile_size) {
+    static_assert(sizeof(SegmentHeader) <= sizeof(uint64_t) * 8,
+                  "Shared frames header does not fit its reserved area");
+    try {
+        if (worker_count <= 0 || stream_count <= 0 || tile_size.empty()) {
+            throw RTSPSharedFramesException(
+                "Shared frames layout is not set!");
+        }
+        name_ = name;
+        owner_ = true;
+        descriptor_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (descriptor_ < 0) {
+            throw RTSPSharedFramesException(
+                "Failed to create shared memory segment " + name_ + ": " +
+                std::strerror(errno));
+        }
+
+        size_t slot_size = Align(Align(sizeof(RTSPSharedStreamHeader)) +
+                                 static_cast<size_t>(tile_size.area()) * 3);
+        size_t segment_size =
+            StreamsOffset(worker_count) + stream_count * slot_size;
+        if (ftruncate(descriptor_, static_cast<off_t>(segment_size)) != 0) {
+            throw RTSPSharedFramesException(
+                "Failed to resize shared memory segment " + name_ + ": " +
+                std::strerror(errno));
+        }
+        if (!Map(segment_size)) {
+            throw RTSPSharedFramesException("Failed to map shared memory "
+                                            "segment " + name_);
+        }
+
+        header_->worker_count = worker_count;
+        header_->stream_count = stream_count;
+        header_->tile_width = tile_size.width;
+        header_->tile_height = tile_size.height;
+        header_->slot_size = slot_size;
+        header_->segment_size = segment_size;
+        for (int worker = 0; worker < worker_count; ++worker) {
+            new (GetWorker(worker)) RTSPSharedWorkerHeader();
+        }
+        for (int stream = 0; stream < stream_count; ++stream) {
+            new (GetStream(stream)) RTSPSharedStreamHeader();
+        }
+        header_->magic = kSegmentMagic;
+        return true;
+    } catch (const RTSPSharedFramesException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    Close();
+    return false;
+}
+
+bool RTSPSharedFrames::Open(const std::string& name) {
+    try {
+        name_ = name;
+        owner_ = false;
+        descriptor_ = shm_open(name_.c_str(), O_RDWR, 0600);
+        if (descriptor_ < 0) {
+            throw RTSPSharedFramesException(
+                "Failed to open shared memory segment " + name_ + ": " +
+                std::strerror(errno));
+        }
+        struct stat segment_stat;
+        if (fstat(descriptor_, &segment_stat) != 0 ||
+            !Map(static_cast<size_t>(segment_stat.st_size))) {
+            throw RTSPSharedFramesException("Failed to map shared memory "
+                                            "segment " + name_);
+        }
+        if (header_->magic != kSegmentMagic ||
+            header_->segment_size != segment_size_) {
+            throw RTSPSharedFramesException("Shared memory segment " + name_ +
+                                            " is not initialized!");
+        }
+        return true;
+    } catch (const RTSPSharedFramesException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    Close();
+    return false;
+}
+
+bool RTSPSharedFrames::Map(size_t segment_size) {
+    void* segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, descriptor_, 0);
+    if (segment == MAP_FAILED) {
+        return false;
+    }
+    segment_ = static_cast<uint8_t*>(segment);
+    segment_size_ = segment_size;
+    header_ = reinterpret_cast<SegmentHeader*>(segment_);
+    return true;
+}
+
+void RTSPSharedFrames::Close() {
+    if (segment_ != nullptr) {
+        munmap(segment_, segment_size_);
+        segment_ = nullptr;
+        header_ = nullptr;
+        segment_size_ = 0;
+    }
+    if (descriptor_ >= 0) {
+        close(descriptor_);
+        descriptor_ = -1;
+        if (owner_) {
+            shm_unlink(name_.c_str());
+        }
+    }
+}
+
+int RTSPSharedFrames::GetWorkerCount() { return header_->worker_count; }
+
+int RTSPSharedFrames::GetStreamCount() { return header_->stream_count; }
+
+cv::Size RTSPSharedFrames::GetTileSize() {
+    return cv::Size(header_->tile_width, header_->tile_height);
+}
+
+size_t RTSPSharedFrames::GetSegmentSize() { return segment_size_; }
+
+RTSPSharedWorkerHeader* RTSPSharedFrames::GetWorker(int worker_index) {
+    return reinterpret_cast<RTSPSharedWorkerHeader*>(
+        segment_ + WorkersOffset() +
+        worker_index * Align(sizeof(RTSPSharedWorkerHeader)));
+}
+
+uint8_t* RTSPSharedFrames::GetSlot(int stream_index) {
+    return segment_ + StreamsOffset(header_->worker_count) +
+           stream_index * header_->slot_size;
+}
+
+RTSPSharedStreamHeader* RTSPSharedFrames::GetStream(int stream_index) {
+    return reinterpret_cast<RTSPSharedStreamHeader*>(GetSlot(stream_index));
+}
+
+void RTSPSharedFrames::Heartbeat(int worker_index) {
+    GetWorker(worker_index)->heartbeat_ms = SteadyNowMs();
+}
+
+int64_t RTSPSharedFrames::GetHeartbeatAge(int worker_index) {
+    return SteadyNowMs() - GetWorker(worker_index)->heartbeat_ms;
+}
+
+void RTSPSharedFrames::WriteFrame(int stream_index, const cv::Mat& frame) {
+    RTSPSharedStreamHeader* stream = GetStream(stream_index);
+    cv::Mat tile(GetTileSize(), CV_8UC3,
+                 GetSlot(stream_index) +
+                     Align(sizeof(RTSPSharedStreamHeader)));
+
+    // Derive both values from the stored one instead of incrementing it, so
+    // a slot left odd by a crashed worker can not flip the parity for good.
+    uint64_t sequence =
+        stream->sequence.load(std::memory_order_relaxed) | uint64_t(1);
+    stream->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (frame.size() == tile.size() && frame.type() == CV_8UC3) {
+        frame.copyTo(tile);
+    } else {
+        cv::resize(frame, tile, tile.size());
+    }
+    stream->sequence.store(sequence + 1, std::memory_order_release);
+}
+
+void RTSPSharedFrames::WriteStats(int stream_index, bool connected,
+                                  RTSPDecodeMode decode_mode,
+                                  const RTSPStreamStats& stats) {
+    RTSPSharedStreamHeader* stream = GetStream(stream_index);
+    stream->connected = connected ? 1 : 0;
+    stream->decode_mode = static_cast<uint32_t>(decode_mode);
+    stream->grabbed_frames = stats.grabbed_frames;
+    stream->decoded_frames = stats.decoded_frames;
+    stream->decode_time_us = stats.decode_time_us;
+}
+
+bool RTSPSharedFrames::ReadFrame(int stream_index, cv::Mat& frame) {
+    RTSPSharedStreamHeader* stream = GetStream(stream_index);
+    cv::Mat tile(GetTileSize(), CV_8UC3,
+                 GetSlot(stream_index) +
+                     Align(sizeof(RTSPSharedStreamHeader)));
+
+    // Retry a few times if the worker is writing the tile concurrently.
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        uint64_t sequence = stream->sequence.load(std::memory_order_acquire);
+        if (sequence == 0) {
+            return false;
+        }
+        if (sequence % 2 == 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        tile.copyTo(frame);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (stream->sequence.load(std::memory_order_relaxed) == sequence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RTSPSharedFrames::WriteMetrics(int worker_index,
+                                    const std::string& metrics) {
+    if (metrics.size() > kSharedMetricsSize) {
+        return false;
+    }
+    RTSPSharedWorkerHeader* worker = GetWorker(worker_index);
+    uint64_t sequence =
+        worker->metrics_sequence.load(std::memory_order_relaxed) | uint64_t(1);
+    worker->metrics_sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(worker->metrics, metrics.data(), metrics.size());
+    worker->metrics_size.store(static_cast<uint32_t>(metrics.size()),
+                               std::memory_order_relaxed);
+    worker->metrics_sequence.store(sequence + 1, std::memory_order_release);
+    return true;
+}
+
+bool RTSPSharedFrames::ReadMetrics(int worker_index, std::string& metrics) {
+    RTSPSharedWorkerHeader* worker = GetWorker(worker_index);
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        uint64_t sequence =
+            worker->metrics_sequence.load(std::memory_order_acquire);
+        if (sequence == 0) {
+            return false;
+        }
+        if (sequence % 2 == 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t size = std::min<size_t>(
+            worker->metrics_size.load(std::memory_order_relaxed),
+            kSharedMetricsSize);
+        metrics.assign(worker->metrics, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (worker->metrics_sequence.load(std::memory_order_relaxed) ==
+            sequence) {
+            return true;
+        }
+    }
+    return false;
+}
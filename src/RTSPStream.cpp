@@ -1,5 +1,37 @@
 #include "RTSPStream.hpp"
 
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+
+// The media clock to wall clock offset tracks the fastest frame arrival and
+// only creeps up by this fraction of the difference per frame, so network
+// jitter barely moves it while a slower camera clock is still followed. The
+// offset is kept fractional, otherwise differences below the divider would
+// never move it.
+const double kClockOffsetCreepDivider = 1000.;
+
+// CPU time of the calling thread, which excludes the time grab() spends
+// blocked on the network.
+uint64_t ThreadCpuNowUs() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 +
+           static_cast<uint64_t>(now.tv_nsec) / 1000;
+}
+
+int64_t WallNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+}  // namespace
+
 RTSPStream::RTSPStream() {}
 
 RTSPStream::~RTSPStream() {
@@ -27,11 +59,25 @@ void RTSPStream::SetPort(const std::string& port) { port_ = port; }
 
 void RTSPStream::SetSource(const std::string& source) { source_ = source; }
 
+void RTSPStream::SetName(const std::string& name) { name_ = name; }
+
+void RTSPStream::SetBackupUrl(const std::string& backup_url) {
+    backup_url_ = backup_url;
+}
+
+void RTSPStream::SetTimeouts(int open_timeout_ms, int read_timeout_ms) {
+    open_timeout_ms_ = open_timeout_ms;
+    read_timeout_ms_ = read_timeout_ms;
+}
+
+std::string RTSPStream::GetName() { return name_; }
+
 bool RTSPStream::Initialize() {
     if (!login_.empty() && !password_.empty() && !ip_address_.empty() &&
         !port_.empty() && !source_.empty()) {
         stream_full_url_ += "rtsp://" + login_ + ":" + password_ + "@" +
                             ip_address_ + ":" + port_ + "/" + source_;
+        primary_url_ = stream_full_url_;
         std::cout << "Try to create a rtsp stream from " + ip_address_ + ":" +
                          port_ + "/" + source_
                   << std::endl;
@@ -39,7 +85,18 @@ bool RTSPStream::Initialize() {
         putenv(std::string("OPENCV_FFMPEG_CAPTURE_OPTIONS=rtsp_transport;tcp")
                    .data());
 
-        if (Connect()) {
+        bool connected = Connect(open_timeout_ms_);
+        if (!connected && !backup_url_.empty()) {
+            // A camera that is down at startup is replaced by its backup
+            // right away; the watchdog fails back once the backup faults.
+            stream_.release();
+            on_backup_ = true;
+            stream_full_url_ = backup_url_;
+            std::cout << "Fail over stream " << name_
+                      << " to its backup source" << std::endl;
+            connected = Connect(open_timeout_ms_);
+        }
+        if (connected) {
             std::cout << "Succesfully create rtsp stream from " + ip_address_ +
                              ":" + port_ + "/" + source_
                       << std::endl;
@@ -60,6 +117,8 @@ bool RTSPStream::Initialize() {
                 running_ = true;
                 connected_ = true;
                 current_frame_ = test_frame;
+                last_arrival_ms_ = WallNowMs();
+                current_timestamp_ms_ = StampFrame(last_arrival_ms_);
 
                 capture_thread_ = std::thread(&RTSPStream::CaptureLoop, this);
                 return true;
@@ -90,7 +149,11 @@ bool RTSPStream::Initialize() {
 
 bool RTSPStream::Connect(int timeout_ms) {
     try {
-        stream_ = cv::VideoCapture(stream_full_url_, cv::CAP_FFMPEG);
+        // FFmpeg only applies the timeouts passed at open time, so a stalled
+        // camera can not block grab() longer than the read timeout.
+        stream_.open(stream_full_url_, cv::CAP_FFMPEG,
+                     {cv::CAP_PROP_OPEN_TIMEOUT_MSEC, timeout_ms,
+                      cv::CAP_PROP_READ_TIMEOUT_MSEC, read_timeout_ms_});
     } catch (const std::exception& e) {
         std::cerr << e.what() << '\n';
     }
@@ -103,8 +166,11 @@ bool RTSPStream::Connect(int timeout_ms) {
 };
 
 void RTSPStream::Reconnect() {
-    std::lock_guard<std::mutex> lock(frame_mutex_);
+    // stream_ is only used by the capture thread, so the frame mutex is not
+    // held here: GetFrame() callers must not block for the whole backoff.
     connected_ = false;
+    // The media clock of the new session starts over.
+    clock_anchored_ = false;
 
     if (stream_.isOpened()) {
         stream_.release();
@@ -114,13 +180,21 @@ void RTSPStream::Reconnect() {
               << std::endl;
 
     for (int attempt = 0; attempt < reconnect_attempts_; ++attempt) {
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(reconnect_times_[attempt]));
+        // Sleep in slices so a failover request or the shutdown does not
+        // wait for the whole backoff.
+        auto wake_up = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(reconnect_times_[attempt]);
+        while (std::chrono::steady_clock::now() < wake_up) {
+            if (failover_requested_ || !running_) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
 
         try {
-            stream_.open(stream_full_url_, cv::CAP_FFMPEG);
-            stream_.set(cv::CAP_PROP_OPEN_TIMEOUT_MSEC, open_timeout_ms_);
-            stream_.set(cv::CAP_PROP_READ_TIMEOUT_MSEC, read_timeout_ms_);
+            stream_.open(stream_full_url_, cv::CAP_FFMPEG,
+                         {cv::CAP_PROP_OPEN_TIMEOUT_MSEC, open_timeout_ms_,
+                          cv::CAP_PROP_READ_TIMEOUT_MSEC, read_timeout_ms_});
 
             if (stream_.isOpened()) {
                 std::cout << "Reconnected successfully to "
@@ -146,23 +220,122 @@ void RTSPStream::Reconnect() {
 
 void RTSPStream::RequestReconnect() { reconnect_requested_ = true; }
 
+void RTSPStream::RequestFailover() { failover_requested_ = true; }
+
+bool RTSPStream::HasBackup() { return !backup_url_.empty(); }
+
+bool RTSPStream::IsOnBackup() { return on_backup_; }
+
+void RTSPStream::Failover() {
+    if (backup_url_.empty()) {
+        Reconnect();
+        return;
+    }
+    connected_ = false;
+    clock_anchored_ = false;
+    if (stream_.isOpened()) {
+        stream_.release();
+    }
+
+    // Switches between the primary and the backup source; a failed backup
+    // falls back to the primary one on the next fault.
+    on_backup_ = !on_backup_;
+    stream_full_url_ = on_backup_ ? backup_url_ : primary_url_;
+    std::cout << "Fail over stream " << name_ << " to its "
+              << (on_backup_ ? "backup" : "primary") << " source"
+              << std::endl;
+    if (Connect(open_timeout_ms_)) {
+        return;
+    }
+    Reconnect();
+}
+
 void RTSPStream::CaptureLoop() {
     while (running_) {
-        if (reconnect_requested_) {
+        if (IsCaptureReleased()) {
+            // Requests are kept until the stream is resumed.
+            if (stream_.isOpened()) {
+                connected_ = false;
+                stream_.release();
+                std::cout << "Paused stream " << name_ << std::endl;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        if (!stream_.isOpened() && !failover_requested_) {
+            // Resumed from a pause, or every reconnect attempt failed.
+            clock_anchored_ = false;
+            if (!Connect(open_timeout_ms_)) {
+                Reconnect();
+            }
+            continue;
+        }
+        if (failover_requested_) {
+            failover_requested_ = false;
+            reconnect_requested_ = false;
+            Failover();
+        } else if (reconnect_requested_) {
             reconnect_requested_ = false;
             Reconnect();
         }
-        cv::Mat frame;
-        if (stream_.read(frame)) {
-            std::lock_guard<std::mutex> lock(frame_mutex_);
-            current_frame_ = frame.clone();
-        } else {
+        uint64_t decode_start_us = ThreadCpuNowUs();
+        bool frame_received = stream_.grab();
+        if (frame_received) {
+            int64_t arrival_ms = WallNowMs();
+            last_arrival_ms_ = arrival_ms;
+            int64_t timestamp_ms = StampFrame(arrival_ms);
+            uint64_t grabbed_frames = ++grabbed_frames_;
+            // grab() already decodes the packet, retrieve() only converts
+            // and copies it; degraded modes skip the latter.
+            if (ShouldDecodeFrame(grabbed_frames)) {
+                cv::Mat frame;
+                frame_received = stream_.retrieve(frame);
+                int downscale = downscale_;
+                if (frame_received && downscale > 1) {
+                    cv::resize(frame, frame, cv::Size(), 1. / downscale,
+                               1. / downscale, cv::INTER_AREA);
+                }
+                if (frame_received) {
+                    std::lock_guard<std::mutex> lock(frame_mutex_);
+                    current_frame_ = frame;
+                    current_timestamp_ms_ = timestamp_ms;
+                    size_t history_depth =
+                        static_cast<size_t>(history_depth_.load());
+                    if (history_depth > 0) {
+                        history_.push_back({timestamp_ms, frame});
+                    }
+                    while (history_.size() > history_depth) {
+                        history_.pop_front();
+                    }
+                    ++decoded_frames_;
+                }
+            }
+            decode_time_us_ += ThreadCpuNowUs() - decode_start_us;
+        }
+        if (!frame_received) {
             connected_ = false;
             Reconnect();
         }
     }
 }
 
+bool RTSPStream::ShouldDecodeFrame(uint64_t grabbed_frames) {
+    if (recorded_) {
+        return true;
+    }
+    switch (decode_mode_.load()) {
+        case RTSPDecodeMode::kFull:
+            return true;
+        case RTSPDecodeMode::kReducedRate:
+            return grabbed_frames % reduced_fps_divider_ == 0;
+        case RTSPDecodeMode::kSparse:
+            return grabbed_frames % sparse_interval_ == 0;
+        case RTSPDecodeMode::kPaused:
+            return false;
+    }
+    return true;
+}
+
 bool RTSPStream::IsRunning() { return running_; }
 
 bool RTSPStream::IsConnected() { return connected_; }
@@ -174,3 +347,118 @@ cv::Mat RTSPStream::GetFrame() {
     }
     return current_frame_.clone();
 }
+
+// Shares the current frame without copying it; callers must not write to it.
+bool RTSPStream::PeekFrame(cv::Mat& frame) {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    frame = current_frame_;
+    return !frame.empty();
+}
+
+
+cv::Size RTSPStream::GetFrameSize() {
+    return cv::Size(stream_width_, stream_height_);
+}
+
+void RTSPStream::SetDecodeMode(RTSPDecodeMode decode_mode) {
+    decode_mode_ = decode_mode;
+}
+
+RTSPDecodeMode RTSPStream::GetDecodeMode() { return decode_mode_; }
+
+void RTSPStream::SetRecorded(bool recorded) { recorded_ = recorded; }
+
+bool RTSPStream::IsRecorded() { return recorded_; }
+
+void RTSPStream::SetMemoryPaused(bool memory_paused) {
+    memory_paused_ = memory_paused;
+}
+
+bool RTSPStream::IsMemoryPaused() { return memory_paused_; }
+
+bool RTSPStream::IsCaptureReleased() {
+    return memory_paused_ ||
+           (decode_mode_ == RTSPDecodeMode::kPaused && !recorded_);
+}
+
+void RTSPStream::SetReducedFpsDivider(int reduced_fps_divider) {
+    reduced_fps_divider_ = std::max(1, reduced_fps_divider);
+}
+
+void RTSPStream::SetSparseInterval(int sparse_interval) {
+    sparse_interval_ = std::max(1, sparse_interval);
+}
+
+RTSPStreamStats RTSPStream::GetStats() {
+    RTSPStreamStats stats;
+    stats.grabbed_frames = grabbed_frames_;
+    stats.decoded_frames = decoded_frames_;
+    stats.decode_time_us = decode_time_us_;
+    stats.last_arrival_ms = last_arrival_ms_;
+    return stats;
+}
+int64_t RTSPStream::StampFrame(int64_t arrival_ms) {
+    // OpenCV does not expose the RTCP sender report NTP time, but the
+    // position of the grabbed frame follows the RTP timestamps of the camera.
+    // Anchoring that media clock on the earliest arrival keeps the network
+    // and decoder jitter out of the frame timestamps.
+    double media_ms = stream_.get(cv::CAP_PROP_POS_MSEC);
+    if (!std::isfinite(media_ms) || media_ms <= 0.) {
+        return arrival_ms;
+    }
+    double offset_ms = static_cast<double>(arrival_ms) - media_ms;
+    if (!clock_anchored_ || offset_ms < clock_offset_ms_) {
+        clock_offset_ms_ = offset_ms;
+        clock_anchored_ = true;
+    } else {
+        clock_offset_ms_ +=
+            (offset_ms - clock_offset_ms_) / kClockOffsetCreepDivider;
+    }
+    return std::llround(media_ms + clock_offset_ms_);
+}
+
+void RTSPStream::SetHistoryDepth(int history_depth) {
+    history_depth_ = std::max(0, history_depth);
+}
+
+int RTSPStream::GetHistoryDepth() { return history_depth_; }
+
+void RTSPStream::SetDownscale(int downscale) {
+    downscale_ = std::max(1, downscale);
+}
+
+int RTSPStream::GetDownscale() { return downscale_; }
+
+size_t RTSPStream::GetMemoryUsage() {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    size_t bytes = current_frame_.total() * current_frame_.elemSize();
+    for (const auto& timed_frame : history_) {
+        // The newest history entry shares its buffer with the current frame.
+        if (timed_frame.frame.data != current_frame_.data) {
+            bytes += timed_frame.frame.total() * timed_frame.frame.elemSize();
+        }
+    }
+    return bytes;
+}
+
+int64_t RTSPStream::GetFrameTimestamp() {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    return current_timestamp_ms_;
+}
+
+bool RTSPStream::GetFrameAt(int64_t timestamp_ms, RTSPTimedFrame& frame) {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    if (current_frame_.empty()) {
+        return false;
+    }
+    frame.timestamp_ms = current_timestamp_ms_;
+    frame.frame = current_frame_;
+    for (const auto& timed_frame : history_) {
+        if (std::llabs(timed_frame.timestamp_ms - timestamp_ms) <
+            std::llabs(frame.timestamp_ms - timestamp_ms)) {
+            frame.timestamp_ms = timed_frame.timestamp_ms;
+            frame.frame = timed_frame.frame;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,395 @@
+#include "RTSPSupervisor.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+RTSPSupervisor::RTSPSupervisor() {}
+
+RTSPSupervisor::~RTSPSupervisor() {
+    running_ = false;
+    if (supervise_thread_.joinable()) {
+        supervise_thread_.join();
+    }
+    for (size_t worker = 0; worker < workers_.size(); ++worker) {
+        StopWorker(static_cast<int>(worker));
+    }
+    shared_frames_.Close();
+}
+
+void RTSPSupervisor::SetConfigPath(const std::string& config_path) {
+    config_path_ = config_path;
+}
+
+void RTSPSupervisor::SetWorkerCount(int worker_count) {
+    worker_count_ = worker_count;
+}
+
+void RTSPSupervisor::SetStreamNames(
+    const std::vector<std::string>& stream_names) {
+    stream_names_ = stream_names;
+}
+
+void RTSPSupervisor::SetTileSize(const cv::Size& tile_size) {
+    tile_size_ = tile_size;
+}
+
+void RTSPSupervisor::SetCpuSets(const std::vector<std::string>& cpu_sets) {
+    cpu_sets_ = cpu_sets;
+}
+
+void RTSPSupervisor::SetNumaPinning(bool numa_pinning) {
+    numa_pinning_ = numa_pinning;
+}
+
+void RTSPSupervisor::SetRestartDelay(int restart_delay_ms) {
+    restart_delay_ms_ = restart_delay_ms;
+}
+
+void RTSPSupervisor::SetHangTimeout(int hang_timeout_ms) {
+    hang_timeout_ms_ = hang_timeout_ms;
+}
+
+void RTSPSupervisor::SetStartupTimeout(int startup_timeout_ms) {
+    startup_timeout_ms_ = startup_timeout_ms;
+}
+
+void RTSPSupervisor::SetMetrics(RTSPMetrics* metrics) { metrics_ = metrics; }
+
+bool RTSPSupervisor::Initialize() {
+    try {
+        if (config_path_.empty()) {
+            throw RTSPSupervisorException(
+                "Supervisor mode requires a config file!");
+        }
+        if (stream_names_.empty()) {
+            throw RTSPSupervisorException("No streams to supervise!");
+        }
+        if (worker_count_ <= 0) {
+            throw RTSPSupervisorException("Worker count must be positive!");
+        }
+        if (tile_size_ == cv::Size(0, 0)) {
+            throw RTSPSupervisorException("Tile size is not set!");
+        }
+        // There is no point in running workers without cameras.
+        worker_count_ =
+            std::min(worker_count_, static_cast<int>(stream_names_.size()));
+
+        if (cpu_sets_.empty() && numa_pinning_) {
+            cpu_sets_ = GetNumaCpuSets();
+        }
+        for (const auto& cpu_set : cpu_sets_) {
+            if (ParseCpuList(cpu_set).empty()) {
+                throw RTSPSupervisorException("Invalid CPU set: " + cpu_set);
+            }
+        }
+
+        shared_frames_name_ = "/rtsp_processor_" + std::to_string(getpid());
+        if (!shared_frames_.Create(shared_frames_name_, worker_count_,
+                                   static_cast<int>(stream_names_.size()),
+                                   tile_size_)) {
+            throw RTSPSupervisorException(
+                "Failed to create shared frames for workers!");
+        }
+
+        workers_.resize(worker_count_);
+        for (int worker = 0; worker < worker_count_; ++worker) {
+            if (!cpu_sets_.empty()) {
+                workers_[worker].cpu_set = cpu_sets_[worker % cpu_sets_.size()];
+            }
+            if (!SpawnWorker(worker)) {
+                throw RTSPSupervisorException("Failed to start worker " +
+                                              std::to_string(worker));
+            }
+        }
+
+        running_ = true;
+        supervise_thread_ = std::thread(&RTSPSupervisor::SuperviseLoop, this);
+        std::cout << "Supervisor started " << worker_count_
+                  << " workers for " << stream_names_.size() << " streams"
+                  << std::endl;
+        return true;
+    } catch (const RTSPSupervisorException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
+
+std::vector<int> RTSPSupervisor::ParseCpuList(const std::string& cpu_list) {
+    // Linux cpulist format, e.g. "0-3,8,10-11".
+    std::vector<int> cpus;
+    std::stringstream ranges(cpu_list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        try {
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                           ? first
+                           : std::stoi(range.substr(dash + 1));
+            if (first < 0 || last < first) {
+                return {};
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception&) {
+            return {};
+        }
+    }
+    return cpus;
+}
+
+std::vector<std::string> RTSPSupervisor::GetNumaCpuSets() {
+    std::vector<std::string> cpu_sets;
+    for (int node = 0;; ++node) {
+        std::ifstream node_cpus("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist");
+        std::string cpu_list;
+        if (!std::getline(node_cpus, cpu_list)) {
+            break;
+        }
+        if (!cpu_list.empty()) {
+            cpu_sets.push_back(cpu_list);
+        }
+    }
+    if (cpu_sets.empty()) {
+        std::cout << "WARNING: NUMA topology is not available, workers are "
+                  << "not pinned." << std::endl;
+    }
+    return cpu_sets;
+}
+
+bool RTSPSupervisor::SpawnWorker(int worker_index) {
+    Worker& worker = workers_[worker_index];
+    std::vector<std::string> arguments = {"RTSPProcessor",
+                                          "--config",
+                                          config_path_,
+                                          "--worker-index",
+                                          std::to_string(worker_index),
+                                          "--worker-count",
+                                          std::to_string(worker_count_),
+                                          "--shm-name",
+                                          shared_frames_name_};
+    if (!worker.cpu_set.empty()) {
+        arguments.push_back("--cpu-set");
+        arguments.push_back(worker.cpu_set);
+    }
+    std::vector<char*> argv;
+    for (auto& argument : arguments) {
+        argv.push_back(argument.data());
+    }
+    argv.push_back(nullptr);
+
+    shared_frames_.GetWorker(worker_index)->ready = 0;
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Failed to fork worker " << worker_index << std::endl;
+        return false;
+    }
+    if (pid == 0) {
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    worker.pid = pid;
+    worker.started_at = std::chrono::steady_clock::now();
+    shared_frames_.GetWorker(worker_index)->pid = pid;
+    std::cout << "Worker " << worker_index << " started with pid " << pid
+              << (worker.cpu_set.empty() ? "" : " on CPUs " + worker.cpu_set)
+              << std::endl;
+    return true;
+}
+
+void RTSPSupervisor::StopWorker(int worker_index) {
+    Worker& worker = workers_[worker_index];
+    if (worker.pid <= 0) {
+        return;
+    }
+    kill(worker.pid, SIGTERM);
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        if (waitpid(worker.pid, nullptr, WNOHANG) == worker.pid) {
+            worker.pid = -1;
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    kill(worker.pid, SIGKILL);
+    waitpid(worker.pid, nullptr, 0);
+    worker.pid = -1;
+}
+
+void RTSPSupervisor::CheckWorker(int worker_index) {
+    Worker& worker = workers_[worker_index];
+    auto now = std::chrono::steady_clock::now();
+
+    if (worker.pid <= 0) {
+        if (now >= worker.restart_at && SpawnWorker(worker_index)) {
+            ++worker.restarts;
+        }
+        return;
+    }
+
+    int status = 0;
+    if (waitpid(worker.pid, &status, WNOHANG) == worker.pid) {
+        std::cout << "Worker " << worker_index << " (pid " << worker.pid
+                  << ") exited with status " << status
+                  << ", restarting its streams" << std::endl;
+        worker.pid = -1;
+        worker.restart_at = now + std::chrono::milliseconds(restart_delay_ms_);
+        for (size_t stream = worker_index; stream < stream_names_.size();
+             stream += worker_count_) {
+            RTSPSharedStreamHeader* shared_stream =
+                shared_frames_.GetStream(static_cast<int>(stream));
+            shared_stream->connected = 0;
+            shared_stream->decoding = 0;
+            // A worker killed while writing a tile leaves its slot odd.
+            uint64_t sequence = shared_stream->sequence.load();
+            shared_stream->sequence = (sequence + 1) & ~uint64_t(1);
+        }
+        return;
+    }
+
+    // Connecting to the cameras may legitimately take a while, so the
+    // heartbeat is only checked once the worker reports it is ready.
+    RTSPSharedWorkerHeader* shared_worker =
+        shared_frames_.GetWorker(worker_index);
+    int64_t heartbeat_age =
+        shared_worker->ready != 0
+            ? shared_frames_.GetHeartbeatAge(worker_index)
+            : std::chrono::duration_cast<std::chrono::milliseconds>(
+                  now - worker.started_at)
+                  .count();
+    int64_t timeout_ms =
+        shared_worker->ready != 0 ? hang_timeout_ms_ : startup_timeout_ms_;
+    if (heartbeat_age > timeout_ms) {
+        // The next check reaps the killed worker and schedules its restart.
+        std::cout << "Worker " << worker_index << " (pid " << worker.pid
+                  << ") is not responding for " << heartbeat_age
+                  << " ms, killing it" << std::endl;
+        kill(worker.pid, SIGKILL);
+    }
+}
+
+void RTSPSupervisor::PublishMetrics() {
+    if (metrics_ == nullptr) {
+        return;
+    }
+    int alive_workers = 0;
+    for (size_t worker = 0; worker < workers_.size(); ++worker) {
+        std::string prefix = "supervisor.workers." + std::to_string(worker);
+        metrics_->SetValue(prefix + ".pid", workers_[worker].pid);
+        metrics_->SetValue(prefix + ".restarts", workers_[worker].restarts);
+        alive_workers += workers_[worker].pid > 0 ? 1 : 0;
+        MergeWorkerMetrics(static_cast<int>(worker));
+    }
+    metrics_->SetValue("supervisor.alive_workers", alive_workers);
+    for (size_t stream = 0; stream < stream_names_.size(); ++stream) {
+        RTSPSharedStreamHeader* shared_stream =
+            shared_frames_.GetStream(static_cast<int>(stream));
+        std::string prefix = "streams." + stream_names_[stream] + ".";
+        metrics_->SetValue(prefix + "worker",
+                           static_cast<double>(stream % worker_count_));
+        metrics_->SetValue(prefix + "connected", shared_stream->connected);
+        metrics_->SetValue(prefix + "grabbed_frames",
+                           static_cast<double>(shared_stream->grabbed_frames));
+        metrics_->SetValue(prefix + "decoded_frames",
+                           static_cast<double>(shared_stream->decoded_frames));
+        metrics_->SetValue(prefix + "decode_time_us",
+                           static_cast<double>(shared_stream->decode_time_us));
+    }
+}
+
+void RTSPSupervisor::MergeWorkerMetrics(int worker_index) {
+    std::string text;
+    if (!shared_frames_.ReadMetrics(worker_index, text)) {
+        return;
+    }
+    nlohmann::json snapshot =
+        nlohmann::json::parse(text, nullptr, /*allow_exceptions=*/false);
+    if (!snapshot.is_object()) {
+        return;
+    }
+    std::string prefix = "supervisor.workers." + std::to_string(worker_index);
+    for (const auto& [block, values] : snapshot.items()) {
+        metrics_->MergeSnapshot(block == "streams" ? block
+                                                   : prefix + "." + block,
+                                values);
+    }
+}
+
+void RTSPSupervisor::SuperviseLoop() {
+    while (running_) {
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            for (int worker = 0; worker < worker_count_; ++worker) {
+                CheckWorker(worker);
+            }
+            PublishMetrics();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+}
+
+bool RTSPSupervisor::IsConnected(int stream_index) {
+    return shared_frames_.GetStream(stream_index)->connected != 0;
+}
+
+RTSPDecodeMode RTSPSupervisor::GetDecodeMode(int stream_index) {
+    return static_cast<RTSPDecodeMode>(
+        shared_frames_.GetStream(stream_index)->decode_mode.load());
+}
+
+void RTSPSupervisor::RequestDecodeMode(int stream_index,
+                                       RTSPDecodeMode decode_mode) {
+    // The worker applies it on its next publish period, also after a restart.
+    shared_frames_.GetStream(stream_index)->requested_decode_mode =
+        static_cast<uint32_t>(decode_mode);
+}
+
+RTSPStreamStats RTSPSupervisor::GetStreamStats(int stream_index) {
+    RTSPSharedStreamHeader* shared_stream =
+        shared_frames_.GetStream(stream_index);
+    RTSPStreamStats stats;
+    stats.grabbed_frames = shared_stream->grabbed_frames;
+    stats.decoded_frames = shared_stream->decoded_frames;
+    stats.decode_time_us = shared_stream->decode_time_us;
+    return stats;
+}
+
+bool RTSPSupervisor::IsDecoding(int stream_index) {
+    return shared_frames_.GetStream(stream_index)->decoding != 0;
+}
+
+bool RTSPSupervisor::IsRecorded(int stream_index) {
+    return shared_frames_.GetStream(stream_index)->recorded != 0;
+}
+
+bool RTSPSupervisor::GetFrame(int stream_index, cv::Mat& frame) {
+    return shared_frames_.ReadFrame(stream_index, frame);
+}
+
+uint64_t RTSPSupervisor::GetFrameSequence(int stream_index) {
+    // Odd while the worker writes the tile; it is read again next period.
+    uint64_t sequence =
+        shared_frames_.GetStream(stream_index)->sequence.load();
+    return sequence % 2 == 0 ? sequence : sequence - 1;
+}
+
+size_t RTSPSupervisor::GetSharedMemorySize() {
+    return shared_frames_.GetSegmentSize();
+}
+
+void RTSPSupervisor::RequestReconnect() {
+    for (size_t stream = 0; stream < stream_names_.size(); ++stream) {
+        shared_frames_.GetStream(static_cast<int>(stream))
+            ->reconnect_requested = 1;
+    }
+}
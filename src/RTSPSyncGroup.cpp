@@ -0,0 +1,153 @@
+#include "RTSPSyncGroup.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+RTSPSyncGroup::RTSPSyncGroup() {}
+
+RTSPSyncGroup::~RTSPSyncGroup() {}
+
+void RTSPSyncGroup::SetName(const std::string& name) { name_ = name; }
+
+std::string RTSPSyncGroup::GetName() { return name_; }
+
+void RTSPSyncGroup::SetTolerance(int tolerance_ms) {
+    tolerance_ms_ = tolerance_ms;
+}
+
+void RTSPSyncGroup::SetHistoryDepth(int history_depth) {
+    history_depth_ = history_depth;
+}
+
+void RTSPSyncGroup::SetMetrics(RTSPMetrics* metrics) { metrics_ = metrics; }
+
+void RTSPSyncGroup::AddStream(RTSPStream* stream) {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    streams_.push_back(stream);
+}
+
+bool RTSPSyncGroup::Initialize() {
+    try {
+        if (streams_.size() < 2) {
+            throw RTSPSyncGroupException("Sync group " + name_ +
+                                         " needs at least two streams!");
+        }
+        if (tolerance_ms_ < 0) {
+            throw RTSPSyncGroupException(
+                "Sync tolerance must not be negative!");
+        }
+        if (history_depth_ < 1) {
+            throw RTSPSyncGroupException(
+                "Sync history depth must be positive!");
+        }
+        for (RTSPStream* stream : streams_) {
+            stream->SetHistoryDepth(history_depth_);
+        }
+        frames_.assign(streams_.size(), RTSPTimedFrame());
+        std::cout << "Sync group " << name_ << " aligns " << streams_.size()
+                  << " streams within " << tolerance_ms_ << " ms"
+                  << std::endl;
+        return true;
+    } catch (const RTSPSyncGroupException& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return false;
+}
+
+bool RTSPSyncGroup::Synchronize() {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    // Disconnected members keep their last frame and do not hold the group
+    // back.
+    int64_t target_ms = INT64_MAX;
+    int64_t newest_min_ms = INT64_MAX;
+    int64_t newest_max_ms = INT64_MIN;
+    for (RTSPStream* stream : streams_) {
+        if (!stream->IsConnected()) {
+            continue;
+        }
+        int64_t newest_ms = stream->GetFrameTimestamp();
+        target_ms = std::min(target_ms, newest_ms);
+        newest_min_ms = std::min(newest_min_ms, newest_ms);
+        newest_max_ms = std::max(newest_max_ms, newest_ms);
+    }
+    if (target_ms == INT64_MAX) {
+        return false;
+    }
+
+    int64_t oldest_ms = INT64_MAX;
+    int64_t latest_ms = INT64_MIN;
+    for (size_t i = 0; i < streams_.size(); ++i) {
+        if (!streams_[i]->IsConnected()) {
+            continue;
+        }
+        RTSPTimedFrame frame;
+        if (streams_[i]->GetFrameAt(target_ms, frame)) {
+            frames_[i] = frame;
+            oldest_ms = std::min(oldest_ms, frame.timestamp_ms);
+            latest_ms = std::max(latest_ms, frame.timestamp_ms);
+        }
+    }
+    if (oldest_ms == INT64_MAX) {
+        return false;
+    }
+
+    int64_t skew_ms = latest_ms - oldest_ms;
+    bool aligned = skew_ms <= tolerance_ms_;
+    if (aligned) {
+        ++stats_.aligned_sets;
+    } else {
+        ++stats_.unaligned_sets;
+    }
+    stats_.skew_ms = skew_ms;
+    stats_.max_skew_ms = std::max(stats_.max_skew_ms, skew_ms);
+    total_skew_ms_ += static_cast<double>(skew_ms);
+    stats_.mean_skew_ms =
+        total_skew_ms_ /
+        static_cast<double>(stats_.aligned_sets + stats_.unaligned_sets);
+    stats_.unsynced_skew_ms = newest_max_ms - newest_min_ms;
+    PublishMetrics(target_ms);
+    return aligned;
+}
+
+bool RTSPSyncGroup::GetFrame(int member, cv::Mat& frame) {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    if (frames_[member].frame.empty()) {
+        return false;
+    }
+    frame = frames_[member].frame;
+    return true;
+}
+
+int64_t RTSPSyncGroup::GetFrameTimestamp(int member) {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    return frames_[member].timestamp_ms;
+}
+
+RTSPSyncStats RTSPSyncGroup::GetStats() {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    return stats_;
+}
+
+void RTSPSyncGroup::PublishMetrics(int64_t target_ms) {
+    if (metrics_ == nullptr) {
+        return;
+    }
+    std::string prefix = "sync." + name_ + ".";
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+    metrics_->SetValue(prefix + "skew_ms", stats_.skew_ms);
+    metrics_->SetValue(prefix + "max_skew_ms", stats_.max_skew_ms);
+    metrics_->SetValue(prefix + "mean_skew_ms", stats_.mean_skew_ms);
+    metrics_->SetValue(prefix + "unsynced_skew_ms", stats_.unsynced_skew_ms);
+    metrics_->SetValue(prefix + "aligned_sets", stats_.aligned_sets);
+    metrics_->SetValue(prefix + "unaligned_sets", stats_.unaligned_sets);
+    // Extra display delay the alignment costs.
+    metrics_->SetValue(prefix + "lag_ms", now_ms - target_ms);
+    for (size_t i = 0; i < streams_.size(); ++i) {
+        metrics_->SetValue("streams." + streams_[i]->GetName() +
+                               ".sync_offset_ms",
+                           frames_[i].timestamp_ms - target_ms);
+    }
+}
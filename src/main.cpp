@@ -1,15 +1,32 @@
+#include <sched.h>
 #include <signal.h>
+#include <sys/prctl.h>
 
+#include <algorithm>
 #include <atomic>
 #include <filesystem>
 #include <iostream>
 
+#include "RTSPClipExporter.hpp"
 #include "RTSPConfig.hpp"
+#include "RTSPDiskWriter.hpp"
+#include "RTSPGovernor.hpp"
+#include "RTSPMemoryManager.hpp"
+#include "RTSPMetrics.hpp"
 #include "RTSPRecorder.hpp"
+#include "RTSPSharedFrames.hpp"
 #include "RTSPStream.hpp"
+#include "RTSPSupervisor.hpp"
+#include "RTSPSyncGroup.hpp"
+#include "RTSPWatchdog.hpp"
 
 std::atomic<bool> stop_processing(false);
 
+const int kWallW = 1280;
+const int kWallH = 720;
+
+const int kFramePeriodMks = 49500;
+
 void SignalHandler(int signal) {
     std::cout << "\nReceived interrupt signal. Stopping..." << std::endl;
     stop_processing = true;
@@ -37,23 +54,487 @@ RTSP stream port (required)"
 RTSP stream source (required)"
               << std::endl;
     std::cout << "  --output PATH        \
-Path to output video file (optional)"
+Directory for recorded video segments (optional)"
               << std::endl;
     std::cout << "  --display            \
 Enable video display on running"
               << std::endl;
+    std::cout << "  --workers N          \
+Split the configured streams across N worker processes"
+              << std::endl;
     std::cout << "  --help               \
 Show this help message"
               << std::endl;
+    std::cout << "Usage: RTSPProcessor export [options]" << std::endl;
+    std::cout << "Clips are remuxed by the ffmpeg executable, which must be "
+              << "on PATH." << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --stream NAME        \
+Name of the recorded stream or \"wall\" (required)"
+              << std::endl;
+    std::cout << "  --from TIME          \
+Clip start, epoch seconds or YYYY-MM-DDTHH:MM:SS (required)"
+              << std::endl;
+    std::cout << "  --to TIME            \
+Clip end, epoch seconds or YYYY-MM-DDTHH:MM:SS (required)"
+              << std::endl;
+    std::cout << "  --config CONFIG/PATH \
+Config file with the recordings path"
+              << std::endl;
+    std::cout << "  --recordings PATH    \
+Recordings path, overrides the config file"
+              << std::endl;
+    std::cout << "  --output PATH        \
+Path to the exported clip"
+              << std::endl;
 }
 
-int main(int argc, char* argv[]) {
-    signal(SIGINT, SignalHandler);
+int RunExport(int argc, char* argv[]) {
+    std::string stream_name = "";
+    std::string recordings_path = "";
+    std::string output_path = "";
+    int64_t from_ms = -1;
+    int64_t to_ms = -1;
 
-    const int kCellW = 640;
-    const int kCellH = 360;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--stream" && i + 1 < argc) {
+            stream_name = argv[++i];
+        } else if (arg == "--from" && i + 1 < argc) {
+            from_ms = RTSPClipExporter::ParseTime(argv[++i]);
+        } else if (arg == "--to" && i + 1 < argc) {
+            to_ms = RTSPClipExporter::ParseTime(argv[++i]);
+        } else if (arg == "--recordings" && i + 1 < argc) {
+            recordings_path = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--config" && i + 1 < argc) {
+            RTSPConfig config(argv[++i]);
+            if (!config.Initialize()) {
+                return 1;
+            }
+            if (recordings_path.empty()) {
+                recordings_path = config.GetSection("video_recorder")
+                                      .value("video_path", "");
+            }
+        } else if (arg == "--help") {
+            PrintUsage();
+            return 0;
+        }
+    }
+
+    if (stream_name.empty() || from_ms < 0 || to_ms < 0) {
+        PrintUsage();
+        return 1;
+    }
+    if (output_path.empty()) {
+        output_path = stream_name + "_" + std::to_string(from_ms / 1000) +
+                      ".mp4";
+    }
+
+    if (recordings_path.empty()) {
+        std::cerr << "Recordings path is not set, pass --recordings or a "
+                  << "--config with video_recorder.video_path" << std::endl;
+        return 1;
+    }
+
+    RTSPClipExporter exporter;
+    exporter.SetRecordingsPath(recordings_path + "/" + stream_name);
+    exporter.SetTimeRange(from_ms, to_ms);
+    exporter.SetOutputPath(output_path);
+    return exporter.Export() ? 0 : 1;
+}
+
+std::unique_ptr<RTSPStream> CreateStream(
+    std::unordered_map<std::string, std::string>& stream,
+    const nlohmann::json& governor_config,
+    const nlohmann::json& watchdog_config) {
+    auto rtsp_stream = std::make_unique<RTSPStream>();
+
+    rtsp_stream->SetName(stream["name"]);
+    rtsp_stream->SetReducedFpsDivider(
+        governor_config.value("reduced_fps_divider", 2));
+    rtsp_stream->SetSparseInterval(
+        governor_config.value("sparse_interval", 25));
+    rtsp_stream->SetLogin(stream["login"]);
+    rtsp_stream->SetPassword(stream["password"]);
+    rtsp_stream->SetIpAddress(stream["ip_address"]);
+    rtsp_stream->SetPort(stream["port"]);
+    rtsp_stream->SetSource(stream["source"]);
+    if (stream.count("backup_url") > 0) {
+        rtsp_stream->SetBackupUrl(stream["backup_url"]);
+    }
+    // The read timeout bounds how long a stalled camera can block grab().
+    rtsp_stream->SetTimeouts(watchdog_config.value("open_timeout_ms", 5000),
+                             watchdog_config.value("stall_timeout_ms", 3000));
+
+    rtsp_stream->Initialize();
+    return rtsp_stream;
+}
+
+std::unique_ptr<RTSPRecorder> CreateRecorder(
+    RTSPStream& rtsp_stream, const nlohmann::json& recorder_config,
+    const std::string& video_path, RTSPDiskWriter* disk_writer) {
+    if (video_path.empty()) {
+        std::cerr << "Recordings path is empty, stream "
+                  << rtsp_stream.GetName() << " will not be recorded"
+                  << std::endl;
+        return nullptr;
+    }
+    if (!rtsp_stream.IsConnected() ||
+        rtsp_stream.GetFrameSize() == cv::Size(0, 0)) {
+        std::cout << "Stream " << rtsp_stream.GetName()
+                  << " is not connected and will not be recorded"
+                  << std::endl;
+        return nullptr;
+    }
+    auto recorder = std::make_unique<RTSPRecorder>();
+
+    recorder->SetOutputPath(video_path + "/" + rtsp_stream.GetName());
+    recorder->SetTargetFPS(recorder_config.value("target_fps", 20));
+    recorder->SetFrameSize(rtsp_stream.GetFrameSize());
+    recorder->SetSegmentDuration(
+        recorder_config.value("segment_duration_s", 300));
+    recorder->SetContainer(recorder_config.value("container", "mp4"));
+    recorder->SetMotionThreshold(
+        recorder_config.value("motion_threshold", 0.));
+    recorder->SetDiskWriter(disk_writer);
+
+    if (!recorder->Initialize()) {
+        return nullptr;
+    }
+    // Keeps frames coming when the governor degrades the stream.
+    rtsp_stream.SetRecorded(true);
+    return recorder;
+}
+
+// Recorder of the composited wall, written to "<video_path>/wall" at the
+// wall refresh rate.
+std::unique_ptr<RTSPRecorder> CreateWallRecorder(
+    const cv::Size& wall_size, const nlohmann::json& recorder_config,
+    const std::string& video_path, RTSPDiskWriter* disk_writer) {
+    if (video_path.empty()) {
+        std::cerr << "Recordings path is empty, the wall will not be recorded"
+                  << std::endl;
+        return nullptr;
+    }
+    auto recorder = std::make_unique<RTSPRecorder>();
 
-    const int kFramePeriodMks = 49500;
+    recorder->SetOutputPath(video_path + "/wall");
+    recorder->SetTargetFPS(
+        recorder_config.value("wall_fps", 1000000 / kFramePeriodMks));
+    recorder->SetFrameSize(wall_size);
+    recorder->SetSegmentDuration(
+        recorder_config.value("segment_duration_s", 300));
+    recorder->SetContainer(recorder_config.value("container", "mp4"));
+    recorder->SetMotionThreshold(
+        recorder_config.value("motion_threshold", 0.));
+    recorder->SetDiskWriter(disk_writer);
+    recorder->SetWallMode(true);
+
+    if (!recorder->Initialize()) {
+        return nullptr;
+    }
+    return recorder;
+}
+
+// Groups of local streams showing the same scene, configured as
+// "groups": {"<group>": ["<stream>", ...]}. Each stream joins one group at
+// most.
+std::vector<std::unique_ptr<RTSPSyncGroup>> CreateSyncGroups(
+    const nlohmann::json& sync_config,
+    std::vector<std::unordered_map<std::string, std::string>>& streams,
+    std::vector<std::unique_ptr<RTSPStream>>& rtsp_streams,
+    std::vector<std::pair<RTSPSyncGroup*, int>>& stream_sync_groups,
+    RTSPMetrics* metrics) {
+    std::vector<std::unique_ptr<RTSPSyncGroup>> sync_groups;
+    // items() only refers to the object, so it must outlive the loop.
+    const nlohmann::json groups =
+        sync_config.value("groups", nlohmann::json::object());
+    for (const auto& group : groups.items()) {
+        auto sync_group = std::make_unique<RTSPSyncGroup>();
+        sync_group->SetName(group.key());
+        sync_group->SetTolerance(sync_config.value("tolerance_ms", 40));
+        sync_group->SetHistoryDepth(sync_config.value("history_depth", 8));
+        sync_group->SetMetrics(metrics);
+
+        std::vector<size_t> members;
+        for (const auto& stream_name : group.value()) {
+            auto stream = std::find_if(
+                streams.begin(), streams.end(),
+                [&](std::unordered_map<std::string, std::string>& s) {
+                    return s["name"] == stream_name.get<std::string>();
+                });
+            size_t idx = static_cast<size_t>(stream - streams.begin());
+            if (stream == streams.end() ||
+                stream_sync_groups[idx].first != nullptr) {
+                std::cout << "WARNING: Stream "
+                          << stream_name.get<std::string>()
+                          << " is unknown or already synchronised and is "
+                          << "left out of sync group " << group.key()
+                          << std::endl;
+                continue;
+            }
+            members.push_back(idx);
+            sync_group->AddStream(rtsp_streams[idx].get());
+        }
+        if (!sync_group->Initialize()) {
+            continue;
+        }
+        for (size_t member = 0; member < members.size(); ++member) {
+            stream_sync_groups[members[member]] = {sync_group.get(),
+                                                   static_cast<int>(member)};
+        }
+        sync_groups.push_back(std::move(sync_group));
+    }
+    return sync_groups;
+}
+
+// Shared writer of all recorders of the process, nullptr when the recorders
+// write their segments themselves.
+std::unique_ptr<RTSPDiskWriter> CreateDiskWriter(
+    const nlohmann::json& disk_writer_config, RTSPMetrics* metrics) {
+    if (!disk_writer_config.value("enabled", false)) {
+        return nullptr;
+    }
+    auto disk_writer = std::make_unique<RTSPDiskWriter>();
+
+    disk_writer->SetBackend(disk_writer_config.value("backend", "io_uring"));
+    disk_writer->SetThreadCount(disk_writer_config.value("threads", 2));
+    disk_writer->SetQueueDepth(disk_writer_config.value("queue_depth", 32));
+    disk_writer->SetChunkSize(
+        disk_writer_config.value("chunk_size_kb", 1024) * size_t(1024));
+    disk_writer->SetMaxBacklog(
+        disk_writer_config.value("max_backlog_mb", 256) * size_t(1 << 20));
+    disk_writer->SetOverflowPolicy(
+        disk_writer_config.value("overflow", "block"));
+    disk_writer->SetFlushPolicy(
+        disk_writer_config.value("flush_policy", "close"));
+    disk_writer->SetFlushInterval(
+        disk_writer_config.value("flush_interval_ms", 1000));
+    disk_writer->SetDirectIO(disk_writer_config.value("direct_io", false));
+    disk_writer->SetMetrics(metrics);
+
+    if (!disk_writer->Initialize()) {
+        return nullptr;
+    }
+    return disk_writer;
+}
+
+void ConfigureGovernor(RTSPGovernor& governor,
+                       const nlohmann::json& governor_config,
+                       RTSPMetrics* metrics) {
+    governor.SetCpuBudget(governor_config.value("cpu_budget_percent", 80.));
+    governor.SetHysteresis(governor_config.value("hysteresis_percent", 10.));
+    governor.SetPeriod(governor_config.value("period_ms", 1000));
+    governor.SetRestoreDelay(governor_config.value("restore_delay_ms", 5000));
+    governor.SetMetrics(metrics);
+}
+
+void ConfigureWatchdog(RTSPWatchdog& watchdog,
+                       const nlohmann::json& watchdog_config,
+                       RTSPMetrics* metrics) {
+    watchdog.SetCheckPeriod(watchdog_config.value("check_period_ms", 200));
+    watchdog.SetWindow(watchdog_config.value("window_ms", 5000));
+    watchdog.SetStallTimeout(watchdog_config.value("stall_timeout_ms", 3000));
+    watchdog.SetFreezeThreshold(
+        watchdog_config.value("freeze_threshold", 0.));
+    watchdog.SetFlatThreshold(watchdog_config.value("flat_threshold", 3.));
+    watchdog.SetBlackThreshold(watchdog_config.value("black_threshold", 16.));
+    watchdog.SetMetrics(metrics);
+}
+
+// The cap is shared evenly by the processes, so in supervisor mode every
+// worker and the compositor get one share each.
+void ConfigureMemoryManager(RTSPMemoryManager& memory_manager,
+                            const nlohmann::json& memory_config,
+                            int process_count, RTSPMetrics* metrics) {
+    memory_manager.SetMemoryCap(memory_config.value("cap_mb", 4096) *
+                                size_t(1 << 20) /
+                                static_cast<size_t>(process_count));
+    memory_manager.SetHysteresis(
+        memory_config.value("hysteresis_percent", 10.));
+    memory_manager.SetPeriod(memory_config.value("period_ms", 500));
+    memory_manager.SetRestoreDelay(
+        memory_config.value("restore_delay_ms", 10000));
+    memory_manager.SetMetrics(metrics);
+}
+
+int GetStreamPriority(std::unordered_map<std::string, std::string>& stream) {
+    return stream.count("priority") > 0 ? std::stoi(stream["priority"]) : 0;
+}
+
+// Side of the square grid the wall is split into. Cells keep the aspect ratio
+// of the wall and are filled column by column.
+int GetGridSide(size_t stream_count) {
+    int grid_side = 1;
+    while (static_cast<size_t>(grid_side) * grid_side < stream_count) {
+        ++grid_side;
+    }
+    return grid_side;
+}
+
+// Worker process of the sharding supervisor: runs every worker_count-th
+// stream of the config and publishes its tiles, stats and metrics to shared
+// memory. The governor runs in the supervisor, which sees the load of all
+// workers; its decode modes are applied here.
+int RunWorker(RTSPConfig& config, int worker_index, int worker_count,
+              const std::string& shared_frames_name,
+              const std::string& cpu_set) {
+    signal(SIGTERM, SignalHandler);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    if (!cpu_set.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : RTSPSupervisor::ParseCpuList(cpu_set)) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Failed to pin worker " << worker_index
+                      << " to CPUs " << cpu_set << std::endl;
+        }
+    }
+
+    RTSPSharedFrames shared_frames;
+    if (!shared_frames.Open(shared_frames_name)) {
+        return 1;
+    }
+
+    std::vector<std::unordered_map<std::string, std::string>> streams =
+        config.GetStreamCredentials();
+    nlohmann::json governor_config = config.GetSection("governor");
+    nlohmann::json watchdog_config = config.GetSection("watchdog");
+
+    // Collected in memory only and forwarded to the supervisor.
+    RTSPMetrics metrics;
+
+    std::vector<int> stream_indices;
+    std::vector<std::unique_ptr<RTSPStream>> rtsp_streams;
+    for (size_t i = worker_index; i < streams.size(); i += worker_count) {
+        stream_indices.push_back(static_cast<int>(i));
+        rtsp_streams.push_back(
+            CreateStream(streams[i], governor_config, watchdog_config));
+        shared_frames.Heartbeat(worker_index);
+    }
+
+    nlohmann::json recorder_config = config.GetSection("video_recorder");
+    // Declared before the recorders, which must be closed first.
+    std::unique_ptr<RTSPDiskWriter> disk_writer;
+    std::vector<std::unique_ptr<RTSPRecorder>> recorders(rtsp_streams.size());
+    std::string video_path = recorder_config.value("video_path", "");
+    if (recorder_config.value("record_video", false) && video_path.empty()) {
+        std::cerr << "Worker " << worker_index << " does not record, "
+                  << "video_recorder.video_path is empty" << std::endl;
+    } else if (recorder_config.value("record_video", false)) {
+        disk_writer =
+            CreateDiskWriter(config.GetSection("disk_writer"), &metrics);
+        for (size_t i = 0; i < rtsp_streams.size(); ++i) {
+            recorders[i] = CreateRecorder(*rtsp_streams[i], recorder_config,
+                                          video_path, disk_writer.get());
+        }
+    }
+
+    RTSPWatchdog watchdog;
+    if (watchdog_config.value("enabled", false)) {
+        ConfigureWatchdog(watchdog, watchdog_config, &metrics);
+        for (const auto& rtsp_stream : rtsp_streams) {
+            watchdog.AddStream(rtsp_stream.get());
+        }
+        watchdog.Initialize();
+    }
+
+    nlohmann::json memory_config = config.GetSection("memory");
+    RTSPMemoryManager memory_manager;
+    if (memory_config.value("enabled", false)) {
+        ConfigureMemoryManager(memory_manager, memory_config,
+                               worker_count + 1, &metrics);
+        for (size_t i = 0; i < rtsp_streams.size(); ++i) {
+            memory_manager.AddStream(
+                rtsp_streams[i].get(),
+                GetStreamPriority(streams[stream_indices[i]]));
+            if (recorders[i]) {
+                memory_manager.AddRecorder(recorders[i].get(),
+                                           rtsp_streams[i]->GetName());
+            }
+        }
+        memory_manager.SetDiskWriter(disk_writer.get());
+        memory_manager.Initialize();
+    }
+
+    shared_frames.Heartbeat(worker_index);
+    shared_frames.GetWorker(worker_index)->ready = 1;
+
+    std::vector<uint64_t> published_frames(rtsp_streams.size(), 0);
+    auto next_metrics = std::chrono::steady_clock::now();
+    while (!stop_processing) {
+        auto start = std::chrono::high_resolution_clock::now();
+        shared_frames.Heartbeat(worker_index);
+        if (std::chrono::steady_clock::now() >= next_metrics) {
+            next_metrics += std::chrono::seconds(1);
+            std::string snapshot = metrics.GetSnapshot().dump(
+                -1, ' ', false, nlohmann::json::error_handler_t::replace);
+            if (!shared_frames.WriteMetrics(worker_index, snapshot)) {
+                std::cerr << "Worker " << worker_index << " metrics exceed "
+                          << kSharedMetricsSize << " bytes" << std::endl;
+            }
+        }
+
+        for (size_t i = 0; i < rtsp_streams.size(); ++i) {
+            RTSPStream* rtsp_stream = rtsp_streams[i].get();
+            RTSPSharedStreamHeader* shared_stream =
+                shared_frames.GetStream(stream_indices[i]);
+            if (shared_stream->reconnect_requested.exchange(0) != 0) {
+                rtsp_stream->RequestReconnect();
+            }
+            rtsp_stream->SetDecodeMode(static_cast<RTSPDecodeMode>(
+                shared_stream->requested_decode_mode.load()));
+
+            // A stream paused by the memory manager shows a paused tile.
+            RTSPDecodeMode decode_mode = rtsp_stream->IsMemoryPaused()
+                                             ? RTSPDecodeMode::kPaused
+                                             : rtsp_stream->GetDecodeMode();
+            shared_stream->decoding = rtsp_stream->IsRunning() &&
+                                      !rtsp_stream->IsMemoryPaused();
+            shared_stream->recorded = rtsp_stream->IsRecorded();
+            RTSPStreamStats stats = rtsp_stream->GetStats();
+            shared_frames.WriteStats(stream_indices[i],
+                                     rtsp_stream->IsConnected(), decode_mode,
+                                     stats);
+            // Only publish tiles that changed since the previous period. A
+            // paused tile is not published, but its recording goes on.
+            cv::Mat frame;
+            if (rtsp_stream->IsConnected() &&
+                stats.decoded_frames != published_frames[i] &&
+                rtsp_stream->PeekFrame(frame)) {
+                published_frames[i] = stats.decoded_frames;
+                if (recorders[i]) {
+                    recorders[i]->SetFrame(frame);
+                }
+                if (decode_mode != RTSPDecodeMode::kPaused) {
+                    shared_frames.WriteFrame(stream_indices[i], frame);
+                }
+            }
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        if (duration.count() < kFramePeriodMks) {
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(kFramePeriodMks - duration.count()));
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "export") {
+        return RunExport(argc, argv);
+    }
+
+    signal(SIGINT, SignalHandler);
 
     const int kEscCode = 27;
 
@@ -61,7 +542,9 @@ int main(int argc, char* argv[]) {
     std::cout
         << "Press Ctrl+C in terminal, ESC or 'q' on window to stop processing."
         << std::endl
-        << "Press 'r' to force reconnection for all streams." << std::endl;
+        << "Press 'r' to force reconnection for all streams." << std::endl
+        << "Press 'm' to put an event marker into the recordings."
+        << std::endl;
     std::cout << "---------------------------------------------" << std::endl;
 
     std::string login = "";
@@ -71,6 +554,10 @@ int main(int argc, char* argv[]) {
     std::string source = "";
     std::string output_path = "";
     bool display = false;
+    int worker_count = -1;
+    int worker_index = -1;
+    std::string shared_frames_name = "";
+    std::string cpu_set = "";
     RTSPConfig config;
 
     // Parse command line arguments
@@ -90,6 +577,16 @@ int main(int argc, char* argv[]) {
             output_path = argv[++i];
         } else if (arg == "--display") {
             display = true;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            worker_count = std::stoi(argv[++i]);
+        } else if (arg == "--worker-count" && i + 1 < argc) {
+            worker_count = std::stoi(argv[++i]);
+        } else if (arg == "--worker-index" && i + 1 < argc) {
+            worker_index = std::stoi(argv[++i]);
+        } else if (arg == "--shm-name" && i + 1 < argc) {
+            shared_frames_name = argv[++i];
+        } else if (arg == "--cpu-set" && i + 1 < argc) {
+            cpu_set = argv[++i];
         } else if (arg == "--config" && i + 1 < argc) {
             config = RTSPConfig(std::string(argv[i + 1]));
             bool configuration_success = config.Initialize();
@@ -102,54 +599,314 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (worker_index >= 0) {
+        return RunWorker(config, worker_index, worker_count,
+                         shared_frames_name, cpu_set);
+    }
+
     std::vector<std::unordered_map<std::string, std::string>> streams =
         config.GetStreamCredentials();
+    size_t stream_count = streams.size();
+    const int grid_side = GetGridSide(stream_count);
+    const cv::Size cell_size(kWallW / grid_side, kWallH / grid_side);
+    auto cell_rect = [&](size_t idx) {
+        return cv::Rect(static_cast<int>(idx) / grid_side * cell_size.width,
+                        static_cast<int>(idx) % grid_side * cell_size.height,
+                        cell_size.width, cell_size.height);
+    };
+
+    nlohmann::json metrics_config = config.GetSection("metrics");
+    RTSPMetrics metrics;
+    metrics.SetOutputPath(metrics_config.value("output_path", ""));
+    metrics.SetReportPeriod(metrics_config.value("period_ms", 1000));
+    metrics.Initialize();
+
+    nlohmann::json governor_config = config.GetSection("governor");
+    nlohmann::json watchdog_config = config.GetSection("watchdog");
+    nlohmann::json supervisor_config = config.GetSection("supervisor");
+    if (worker_count < 0) {
+        worker_count = supervisor_config.value("workers", 0);
+    }
+    bool supervisor_mode = worker_count > 0;
+
+    nlohmann::json recorder_config = config.GetSection("video_recorder");
+    std::string video_path = output_path.empty()
+                                 ? recorder_config.value("video_path", "")
+                                 : output_path;
+    bool record_video =
+        recorder_config.value("record_video", false) || !output_path.empty();
+    bool record_wall = recorder_config.value("record_wall", false);
+    if ((record_video || record_wall) && video_path.empty()) {
+        std::cerr << "Recording is enabled but video_recorder.video_path is "
+                  << "empty, set it or pass --output" << std::endl;
+        return 0;
+    }
 
     std::vector<std::unique_ptr<RTSPStream>> rtsp_streams;
-    rtsp_streams.reserve(streams.size());
+    // Declared before the recorders, which must be closed first.
+    std::unique_ptr<RTSPDiskWriter> disk_writer;
+    std::vector<std::unique_ptr<RTSPRecorder>> recorders(stream_count);
+    RTSPSupervisor supervisor;
+    RTSPGovernor governor;
+    RTSPWatchdog watchdog;
+
+    if ((record_video && !supervisor_mode) || record_wall) {
+        disk_writer =
+            CreateDiskWriter(config.GetSection("disk_writer"), &metrics);
+    }
 
-    for (auto stream : streams) {
-        rtsp_streams.push_back(std::move(std::make_unique<RTSPStream>()));
+    if (supervisor_mode) {
+        if (!output_path.empty()) {
+            std::cout << "WARNING: --output only applies to the wall "
+                      << "recording in supervisor mode, workers record to "
+                      << "video_recorder.video_path." << std::endl;
+        }
+        std::vector<std::string> stream_names;
+        for (auto stream : streams) {
+            stream_names.push_back(stream["name"]);
+        }
+        supervisor.SetConfigPath(config.GetConfigPath());
+        supervisor.SetWorkerCount(worker_count);
+        supervisor.SetStreamNames(stream_names);
+        supervisor.SetTileSize(cell_size);
+        supervisor.SetCpuSets(supervisor_config.value(
+            "cpu_sets", std::vector<std::string>()));
+        supervisor.SetNumaPinning(supervisor_config.value("numa", false));
+        supervisor.SetRestartDelay(
+            supervisor_config.value("restart_delay_ms", 1000));
+        supervisor.SetHangTimeout(
+            supervisor_config.value("hang_timeout_ms", 10000));
+        supervisor.SetStartupTimeout(
+            supervisor_config.value("startup_timeout_ms", 120000));
+        supervisor.SetMetrics(&metrics);
+        if (!supervisor.Initialize()) {
+            return 0;
+        }
+
+        if (governor_config.value("enabled", false)) {
+            ConfigureGovernor(governor, governor_config, &metrics);
+            for (size_t i = 0; i < streams.size(); ++i) {
+                governor.AddStream(&supervisor, static_cast<int>(i),
+                                   stream_names[i],
+                                   GetStreamPriority(streams[i]));
+            }
+            governor.Initialize();
+        }
+    } else {
+        rtsp_streams.reserve(stream_count);
+        for (auto stream : streams) {
+            rtsp_streams.push_back(
+                CreateStream(stream, governor_config, watchdog_config));
+            if (record_video) {
+                recorders[rtsp_streams.size() - 1] =
+                    CreateRecorder(*rtsp_streams.back(), recorder_config,
+                                   video_path, disk_writer.get());
+            }
+        }
+
+        if (governor_config.value("enabled", false)) {
+            ConfigureGovernor(governor, governor_config, &metrics);
+            for (size_t i = 0; i < rtsp_streams.size(); ++i) {
+                governor.AddStream(rtsp_streams[i].get(),
+                                   GetStreamPriority(streams[i]));
+            }
+            governor.Initialize();
+        }
+
+        if (watchdog_config.value("enabled", false)) {
+            ConfigureWatchdog(watchdog, watchdog_config, &metrics);
+            for (const auto& rtsp_stream : rtsp_streams) {
+                watchdog.AddStream(rtsp_stream.get());
+            }
+            watchdog.Initialize();
+        }
+    }
+
+    // Streams of a sync group are shown and recorded from the time-aligned
+    // frames the group picks instead of their newest ones.
+    nlohmann::json sync_config = config.GetSection("sync");
+    std::vector<std::unique_ptr<RTSPSyncGroup>> sync_groups;
+    std::vector<std::pair<RTSPSyncGroup*, int>> stream_sync_groups(
+        stream_count, {nullptr, -1});
+    if (sync_config.value("enabled", false)) {
+        if (supervisor_mode) {
+            std::cout << "WARNING: Sync groups are not supported in "
+                      << "supervisor mode and will be ignored." << std::endl;
+        } else {
+            sync_groups = CreateSyncGroups(sync_config, streams, rtsp_streams,
+                                           stream_sync_groups, &metrics);
+        }
+    }
+
+    // The grid is filled either from the local streams or from the tiles
+    // published by the supervised workers.
+    auto is_paused = [&](size_t idx) {
+        if (supervisor_mode) {
+            return supervisor.GetDecodeMode(static_cast<int>(idx)) ==
+                   RTSPDecodeMode::kPaused;
+        }
+        return rtsp_streams[idx]->IsMemoryPaused() ||
+               rtsp_streams[idx]->GetDecodeMode() == RTSPDecodeMode::kPaused;
+    };
+    // Changes whenever a new frame of the stream is available, 0 before the
+    // first one.
+    auto frame_sequence = [&](size_t idx) -> uint64_t {
+        if (stream_sync_groups[idx].first != nullptr) {
+            return static_cast<uint64_t>(
+                stream_sync_groups[idx].first->GetFrameTimestamp(
+                    stream_sync_groups[idx].second));
+        }
+        return supervisor_mode
+                   ? supervisor.GetFrameSequence(static_cast<int>(idx))
+                   : rtsp_streams[idx]->GetStats().decoded_frames;
+    };
+    auto fetch_frame = [&](size_t idx, cv::Mat& frame) {
+        if (supervisor_mode) {
+            return supervisor.IsConnected(static_cast<int>(idx)) &&
+                   supervisor.GetFrame(static_cast<int>(idx), frame);
+        }
+        if (stream_sync_groups[idx].first != nullptr) {
+            if (!stream_sync_groups[idx].first->GetFrame(
+                    stream_sync_groups[idx].second, frame)) {
+                return false;
+            }
+        } else if (!rtsp_streams[idx]->IsConnected()) {
+            return false;
+        } else {
+            frame = rtsp_streams[idx]->GetFrame();
+        }
+        return true;
+    };
+    // Recordings get the same frames as the tiles, independently of the
+    // tile being paused, and each new frame once.
+    std::vector<uint64_t> recorded_sequences(stream_count, 0);
+    auto feed_recorder = [&](size_t idx) {
+        if (!recorders[idx]) {
+            return;
+        }
+        uint64_t sequence = frame_sequence(idx);
+        if (sequence == 0 || sequence == recorded_sequences[idx]) {
+            return;
+        }
+        cv::Mat frame;
+        bool fetched =
+            stream_sync_groups[idx].first != nullptr
+                ? stream_sync_groups[idx].first->GetFrame(
+                      stream_sync_groups[idx].second, frame)
+                : rtsp_streams[idx]->IsConnected() &&
+                      rtsp_streams[idx]->PeekFrame(frame);
+        if (fetched) {
+            recorded_sequences[idx] = sequence;
+            recorders[idx]->SetFrame(frame);
+        }
+    };
 
-        rtsp_streams.back().get()->SetLogin(stream["login"]);
-        rtsp_streams.back().get()->SetPassword(stream["password"]);
-        rtsp_streams.back().get()->SetIpAddress(stream["ip_address"]);
-        rtsp_streams.back().get()->SetPort(stream["port"]);
-        rtsp_streams.back().get()->SetSource(stream["source"]);
+    std::vector<cv::Mat> frames(stream_count + 1);
+    frames.back() = cv::Mat::zeros(kWallH, kWallW, CV_8UC3);
 
-        rtsp_streams.back().get()->Initialize();
+    // Records the canvas exactly as shown on the wall.
+    std::unique_ptr<RTSPRecorder> wall_recorder;
+    if (record_wall && stream_count > 0) {
+        wall_recorder =
+            CreateWallRecorder(cv::Size(kWallW, kWallH), recorder_config,
+                               video_path, disk_writer.get());
     }
 
-    std::vector<cv::Mat> frames(rtsp_streams.size() + 1);
-    frames.back() = cv::Mat(kCellW * 2, kCellH * 2, CV_8UC3);
-    cv::resize(frames.back(), frames.back(), {kCellW * 2, kCellH * 2});
+    // Declared last so it stops before the buffers it accounts are freed.
+    nlohmann::json memory_config = config.GetSection("memory");
+    RTSPMemoryManager memory_manager;
+    bool manage_memory = memory_config.value("enabled", false);
+    if (manage_memory) {
+        ConfigureMemoryManager(memory_manager, memory_config,
+                               supervisor_mode ? worker_count + 1 : 1,
+                               &metrics);
+        // Registered after the sync groups sized the frame histories.
+        for (size_t i = 0; i < rtsp_streams.size(); ++i) {
+            memory_manager.AddStream(rtsp_streams[i].get(),
+                                     GetStreamPriority(streams[i]));
+            if (recorders[i]) {
+                memory_manager.AddRecorder(recorders[i].get(),
+                                           rtsp_streams[i]->GetName());
+            }
+        }
+        if (wall_recorder) {
+            memory_manager.AddRecorder(wall_recorder.get(), "wall");
+        }
+        memory_manager.SetDiskWriter(disk_writer.get());
+        if (supervisor_mode) {
+            memory_manager.ReportUsage("shared_frames",
+                                       supervisor.GetSharedMemorySize());
+        }
+        memory_manager.Initialize();
+    }
 
-    int stream_idx = 0;
+    // Sequence of the frame each tile shows, so unchanged tiles are neither
+    // redrawn nor re-encoded.
+    const uint64_t kPausedTile = UINT64_MAX;
+    std::vector<uint64_t> tile_sequences(stream_count, 0);
 
     while (!stop_processing) {
         auto start = std::chrono::high_resolution_clock::now();
-        for (const auto& rtsp_stream : rtsp_streams) {
-            if (rtsp_stream.get()->IsConnected()) {
-                frames[stream_idx] = rtsp_streams[stream_idx].get()->GetFrame();
-                if (rtsp_streams.size() > 1) {
-                    cv::resize(frames[stream_idx], frames[stream_idx],
-                               {kCellW, kCellH});
-                    frames[stream_idx].copyTo(frames.back()(
-                        cv::Rect(stream_idx / 2 * kCellW,
-                                 stream_idx % 2 * kCellH, kCellW, kCellH)));
-                } else if (rtsp_streams.size() == 1) {
-                    cv::resize(frames[stream_idx], frames[stream_idx],
-                               {1280, 720});
+        bool wall_changed = false;
+        for (const auto& sync_group : sync_groups) {
+            sync_group->Synchronize();
+        }
+        for (size_t stream_idx = 0; stream_idx < stream_count; ++stream_idx) {
+            feed_recorder(stream_idx);
+            uint64_t sequence = is_paused(stream_idx)
+                                    ? kPausedTile
+                                    : frame_sequence(stream_idx);
+            if (sequence == 0 || sequence == tile_sequences[stream_idx]) {
+                continue;
+            }
+            if (sequence == kPausedTile) {
+                // The governor or the memory manager paused this tile: keep
+                // the grid layout and
+                // skip the resize and copy work.
+                cv::Rect tile = cell_rect(stream_idx);
+                cv::Mat& canvas = stream_count > 1 ? frames.back() : frames[0];
+                if (canvas.empty()) {
+                    canvas = cv::Mat::zeros(kWallH, kWallW, CV_8UC3);
+                }
+                canvas(tile).setTo(cv::Scalar(0, 0, 0));
+                cv::putText(canvas, "PAUSED",
+                            cv::Point(tile.x + 20, tile.y + 40),
+                            cv::FONT_HERSHEY_SIMPLEX, 1.,
+                            cv::Scalar(0, 0, 255), 2);
+                tile_sequences[stream_idx] = sequence;
+                wall_changed = true;
+            } else if (fetch_frame(stream_idx, frames[stream_idx])) {
+                tile_sequences[stream_idx] = sequence;
+                wall_changed = true;
+                cv::resize(frames[stream_idx], frames[stream_idx], cell_size);
+                if (stream_count > 1) {
+                    frames[stream_idx].copyTo(
+                        frames.back()(cell_rect(stream_idx)));
                 }
             }
-            ++stream_idx;
         }
-        stream_idx = 0;
 
-        cv::line(frames.back(), cv::Point(kCellW, 0),
-                 cv::Point(kCellW, kCellH * 2), cv::Scalar(0, 0, 0), 2);
-        cv::line(frames.back(), cv::Point(0, kCellH),
-                 cv::Point(kCellW * 2, kCellH), cv::Scalar(0, 0, 0), 2);
+        for (int line = 1; line < grid_side; ++line) {
+            cv::line(frames.back(), cv::Point(line * cell_size.width, 0),
+                     cv::Point(line * cell_size.width, kWallH),
+                     cv::Scalar(0, 0, 0), 2);
+            cv::line(frames.back(), cv::Point(0, line * cell_size.height),
+                     cv::Point(kWallW, line * cell_size.height),
+                     cv::Scalar(0, 0, 0), 2);
+        }
+
+        if (wall_recorder && wall_changed) {
+            wall_recorder->SetFrame(stream_count > 1 ? frames.back()
+                                                     : frames[0]);
+        }
+
+        if (manage_memory) {
+            size_t compositor_bytes = 0;
+            for (const auto& frame : frames) {
+                compositor_bytes += frame.total() * frame.elemSize();
+            }
+            memory_manager.ReportUsage("compositor", compositor_bytes);
+        }
 
         if (display) {
             if (!frames.back().empty()) {
@@ -162,9 +919,21 @@ int main(int argc, char* argv[]) {
                 if (key == kEscCode || key == 'q') {
                     stop_processing = true;
                 } else if (key == 'r') {
+                    if (supervisor_mode) {
+                        supervisor.RequestReconnect();
+                    }
                     for (const auto& rtsp_stream : rtsp_streams) {
                         rtsp_stream.get()->RequestReconnect();
                     }
+                } else if (key == 'm') {
+                    for (const auto& recorder : recorders) {
+                        if (recorder) {
+                            recorder->MarkEvent();
+                        }
+                    }
+                    if (wall_recorder) {
+                        wall_recorder->MarkEvent();
+                    }
                 }
 
                 // Check if window was closed